@@ -7,13 +7,14 @@ uniform sampler2D tile;// Name hardcoded in renderer_impl_x.cpp. TODO: Add const
 in VS_OUT {
     vec3 FragPos;
     vec2 TexCoords;
+    vec4 Tint;
 } fs_in;
 
 out vec4 FragColor;
 
 void main() {
-    FragColor = texture(tile, fs_in.TexCoords).rgba;
-    if (texture(tile, fs_in.TexCoords).a == 0) { gl_FragDepth = 99999; return; }
-
-    gl_FragDepth = gl_FragCoord.z;
+    vec4 color = texture(tile, fs_in.TexCoords);
+    // Transparent texels must not write depth.
+    if (color.a == 0) discard;
+    FragColor = color * fs_in.Tint;
 }
\ No newline at end of file
@@ -5,7 +5,7 @@ uniform sampler2D tex;
 
 void main()
 {
-    if (texture(tex, TexCoords).a == 0) { gl_FragDepth = 99999; return; }
-
-    gl_FragDepth = gl_FragCoord.z;
+    // Transparent texels don't occlude anything. Depth is left to fixed-function so that early
+    // depth testing keeps working.
+    if (texture(tex, TexCoords).a == 0) discard;
 }
\ No newline at end of file
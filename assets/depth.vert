@@ -1,13 +1,22 @@
 #version 430 core
-in vec3 iPos;
-in vec2 iTexCoords;
+layout(location = 0) in vec3 iPos;
+layout(location = 1) in vec2 iTexCoords;
+// Per-instance offset. Commands that aren't instanced get a zero offset.
+layout(location = 2) in vec3 iInstanceOffset;
 
-layout (location = 0) uniform mat4 model;
-layout (location = 3) uniform mat4 lightSpaceMatrix;
+// Same uniforms as the tile shaders. Shadow maps use the light matrix as the projection and an
+// identity view matrix.
+layout(location = 0) uniform mat4 model;
+layout(location = 1) uniform mat4 projection;
+layout(location = 2) uniform mat4 view;
 
 out vec2 TexCoords;
+// The depth prepass must produce exactly the same depth as the tile shaders, so both compute
+// the position with the same expression.
+invariant gl_Position;
 
 void main() {
     TexCoords = iTexCoords;
-    gl_Position = lightSpaceMatrix * model * vec4(iPos, 1.0);
+    vec3 fragPos = vec3(model * vec4(iPos + iInstanceOffset, 1.0));
+    gl_Position = projection * view * vec4(fragPos, 1.0);
 }
\ No newline at end of file
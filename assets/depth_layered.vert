@@ -0,0 +1,23 @@
+#version 450 core
+#extension GL_ARB_shader_viewport_layer_array : require
+#define MAX_SHADOW_VIEWS 16
+
+layout(location = 0) in vec3 iPos;
+layout(location = 1) in vec2 iTexCoords;
+// Per-instance data. Each instance is drawn once for every light that sees it, with the index of
+// that light in the red channel of the tint.
+layout(location = 2) in vec3 iInstanceOffset;
+layout(location = 3) in vec4 iInstanceTint;
+
+layout(location = 0) uniform mat4 model;
+layout(location = 2) uniform mat4 lightSpaceMatrices[MAX_SHADOW_VIEWS];
+
+out vec2 TexCoords;
+
+void main() {
+    int view = int(iInstanceTint.r * 255.0 + 0.5);
+    TexCoords = iTexCoords;
+    // Each light has its own viewport, placed over its tile in the shadow atlas.
+    gl_ViewportIndex = view;
+    gl_Position = lightSpaceMatrices[view] * model * vec4(iPos + iInstanceOffset, 1.0);
+}
@@ -3,52 +3,78 @@
 in vec2 TexCoords;
 
 uniform sampler2D tile;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
-uniform sampler2D shadow;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
+uniform sampler2DShadow shadow;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
+#define SHADOW_QUALITY_OFF 0
+#define SHADOW_QUALITY_HARD 1
+#define SHADOW_QUALITY_PCF2X2 2
+#define SHADOW_QUALITY_PCF5X5 3
+/// One of the SHADOW_QUALITY values, defined by the renderer. Matches ShadowQuality.
+#ifndef SHADOW_QUALITY
+#define SHADOW_QUALITY SHADOW_QUALITY_PCF5X5
+#endif
 uniform sampler2D palette;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
 
 in VS_OUT {
     vec3 FragPos;
     vec2 TexCoords;
     vec4 FragPosLightSpace;
+    vec4 Tint;
 } fs_in;
 
 out vec4 FragColor;
 
 float ShadowCalculation(vec4 fragPosLightSpace)
 {
+#if SHADOW_QUALITY == SHADOW_QUALITY_OFF
+    return 0.0;
+#endif
     // perform perspective divide (not really neccesary for ortho projection, but whatever)
     vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
     // transform to [0,1] range
     projCoords = projCoords * 0.5 + 0.5;
-    // projCoords = vec3(projCoords.x, 1.0 - projCoords.y, projCoords.z);
-    float closestDepth = texture(shadow, projCoords.xy).r;
+    vec2 projCoords2D = projCoords.xy;
     float currentDepth = projCoords.z;
-    float bias = 0.0005;
 
     if(currentDepth == 0) return 0.0;
 
-    float f_shadow = 0.0;
-    vec2 texelSize = 1.0 / textureSize(shadow, 0);
-    for(int x = -1; x <= 1; ++x)
+    float bias = 0.0005;
+    // Depth comparisons return 1 where the fragment is lit.
+    float refDepth = currentDepth - bias;
+#if SHADOW_QUALITY == SHADOW_QUALITY_HARD
+    return 1.0 - texture(shadow, vec3(projCoords2D, refDepth));
+#elif SHADOW_QUALITY == SHADOW_QUALITY_PCF2X2
+    return 1.0 - dot(textureGather(shadow, projCoords2D, refDepth), vec4(0.25));
+#endif
+    // 3x3 gathers cover 6x6 texels. Leave out the last row and column to get a 5x5 kernel.
+    float f_lit = 0.0;
+    for (int x = -2; x <= 2; x += 2)
     {
-        for(int y = -1; y <= 1; ++y)
+        for (int y = -2; y <= 2; y += 2)
         {
-            float pcfDepth = texture(shadow, projCoords.xy + vec2(x, y) * texelSize).r;
-            f_shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
+            // Gathered texels are (x, y + 1), (x + 1, y + 1), (x + 1, y) and (x, y).
+            vec4 lit = textureGatherOffset(shadow, projCoords2D, refDepth, ivec2(x, y));
+            vec4 weights = vec4(y < 2 ? 1.0 : 0.0, x < 2 && y < 2 ? 1.0 : 0.0, x < 2 ? 1.0 : 0.0, 1.0);
+            f_lit += dot(lit, weights);
         }
     }
-    f_shadow /= 9.0;
-    return f_shadow;
+    return 1.0 - f_lit / 25.0;
 }
 
 void main() {
-    float f_shadow = ShadowCalculation(fs_in.FragPosLightSpace);
     vec4 original_color = texture(tile, fs_in.TexCoords);
+    // Transparent texels must not write depth. Discarding them before lighting also skips its cost.
+    if (original_color.a == 0) discard;
+    float f_shadow = ShadowCalculation(fs_in.FragPosLightSpace);
 
+    // Shade and color indices. Packed textures only have a red channel, so their green channel
+    // reads as 0, which is never a valid color index in unpacked ones.
+    vec2 indices = original_color.rg * 255.0;
+    if (original_color.g == 0) {
+        uint packed = uint(round(indices.x));
+        indices = vec2(packed & 0xFu, packed >> 4u);
+    }
     // 0 is transparent
-    if(original_color.r == 0) FragColor = vec4(0);
-    else FragColor = texelFetch(palette, max(ivec2(original_color.rg * 255.0- vec2(f_shadow + 1, 0)), ivec2(0,0)), 0);
-    if (original_color.a == 0) { gl_FragDepth = 99999; return; }
-
-    gl_FragDepth = gl_FragCoord.z;
+    if(indices.x == 0) FragColor = vec4(0);
+    else FragColor = texelFetch(palette, max(ivec2(indices - vec2(f_shadow + 1, 0)), ivec2(0,0)), 0);
+    FragColor *= fs_in.Tint;
 }
\ No newline at end of file
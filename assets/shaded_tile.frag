@@ -1,13 +1,30 @@
 #version 450 core
-#define MAX_DIRECTIONAL_LIGHTS 5
-#define MAX_POINT_LIGHTS 20
 
 in vec2 TexCoords;
 
 uniform sampler2D tile;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
-uniform sampler2D shadow;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
+uniform sampler2DShadow shadow;// Name hardcoded in renderer_impl_x.cpp. TODO: Add constexpr variable in separate file
+#define SHADOW_QUALITY_OFF 0
+#define SHADOW_QUALITY_HARD 1
+#define SHADOW_QUALITY_PCF2X2 2
+#define SHADOW_QUALITY_PCF5X5 3
+/// One of the SHADOW_QUALITY values, defined by the renderer. Matches ShadowQuality.
+#ifndef SHADOW_QUALITY
+#define SHADOW_QUALITY SHADOW_QUALITY_PCF5X5
+#endif
+/// Defined by the renderer to 0 when no point light is on screen.
+#ifndef POINT_LIGHTS
+#define POINT_LIGHTS 1
+#endif
+/// Defined by the renderer to the amount of directional lights when there are few of them, so
+/// that their loop can be unrolled. Otherwise, it's read from the light buffer.
+#ifdef DIRECTIONAL_LIGHT_COUNT
+const uint DIR_LIGHT_COUNT = DIRECTIONAL_LIGHT_COUNT;
+#else
+#define DIR_LIGHT_COUNT lights.directionalLightCount
+#endif
 
-layout(std140) struct DirectionalLight {
+struct DirectionalLight {
 /// Color RGB is color, alpha is light intensity
 /// lightAtlasPos XY is atlas pos, Z is tile size
                             // base // aligned
@@ -17,7 +34,7 @@ layout(std140) struct DirectionalLight {
                                     // 96
 };
 
-layout(std140) struct PointLight {
+struct PointLight {
 /// Color RGB is color, alpha is light intensity
 /// lightAtlasPos XY is atlas pos, Z is tile size
                             // base // aligned
@@ -29,52 +46,79 @@ layout(std140) struct PointLight {
                                     // 128
 };
 
-layout(std140, binding = 5) uniform Lights {
+layout(std430, binding = 5) readonly buffer Lights {
                                                                 // base // aligned
-    DirectionalLight directionalLights[MAX_DIRECTIONAL_LIGHTS]; // 480  // 0
-    uint directionalLightCount;                                 // 4    // 480
-    PointLight pointLights[MAX_POINT_LIGHTS];                   // 2560 // 496
-    uint pointLightCount;                                       // 4    // 3056
-    vec3 ambientLightColor;                                     // 12   // 3072
-                                                                        // 3088
+    vec3 ambientLightColor;                                     // 12   // 0
+    uint directionalLightCount;                                 // 4    // 12
+    /// The screen is split in tiles of tileSize pixels, each with its own point light list.
+    uvec2 tileCount;                                            // 8    // 16
+    uint tileSize;                                              // 4    // 24
+    uint pointLightCount;                                       // 4    // 28
+    DirectionalLight directionalLights[];                       //      // 32
 } lights;
 
+layout(std430, binding = 6) readonly buffer PointLights {
+    PointLight pointLights[];
+};
+
+/// The first index (Into lightGrid) and count of each tile's point lights, as consecutive pairs,
+/// followed by the point light indices of every tile.
+layout(std430, binding = 7) readonly buffer LightGrid {
+    uint lightGrid[];
+};
+
 in VS_OUT {
     vec3 FragPos;
     vec2 TexCoords;
+    vec4 Tint;
 } fs_in;
 
 out vec4 FragColor;
 
 float ShadowCalculation(vec2 lightAtlasPos, float lightAtlasSize, vec4 fragPosLightSpace)
 {
+    // Lights without a tile in the atlas don't cast shadows.
+#if SHADOW_QUALITY == SHADOW_QUALITY_OFF
+    return 0.0;
+#endif
+    if (lightAtlasSize == 0) return 0.0;
     // perform perspective divide (not really neccesary for ortho projection, but whatever)
     vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
     // transform to [0,1] range
     projCoords = projCoords * 0.5 + 0.5;
     vec2 projCoords2D = lightAtlasPos + projCoords.xy * lightAtlasSize;
     float currentDepth = projCoords.z;
-    float bias = 0.0005;
-
     if (currentDepth == 0) return 0.0;
 
-    float f_shadow = 0.0;
-    vec2 texelSize = 1.0 / textureSize(shadow, 0);
-    for (int x = -2; x <= 2; ++x)
+    float bias = 0.0005;
+    // Depth comparisons return 1 where the fragment is lit.
+    float refDepth = currentDepth - bias;
+#if SHADOW_QUALITY == SHADOW_QUALITY_HARD
+    return 1.0 - texture(shadow, vec3(projCoords2D, refDepth));
+#elif SHADOW_QUALITY == SHADOW_QUALITY_PCF2X2
+    return 1.0 - dot(textureGather(shadow, projCoords2D, refDepth), vec4(0.25));
+#endif
+    // 3x3 gathers cover 6x6 texels. Leave out the last row and column to get a 5x5 kernel.
+    float f_lit = 0.0;
+    for (int x = -2; x <= 2; x += 2)
     {
-        for (int y = -2; y <= 2; ++y)
+        for (int y = -2; y <= 2; y += 2)
         {
-            float pcfDepth = texture(shadow, projCoords2D + vec2(x, y) * texelSize * 5.0).r;
-            f_shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
+            // Gathered texels are (x, y + 1), (x + 1, y + 1), (x + 1, y) and (x, y).
+            vec4 lit = textureGatherOffset(shadow, projCoords2D, refDepth, ivec2(x, y));
+            vec4 weights = vec4(y < 2 ? 1.0 : 0.0, x < 2 && y < 2 ? 1.0 : 0.0, x < 2 ? 1.0 : 0.0, 1.0);
+            f_lit += dot(lit, weights);
         }
     }
-    f_shadow /= 25.0;
-    return f_shadow;
+    return 1.0 - f_lit / 25.0;
 }
 
 void main() {
+    vec4 color = texture(tile, fs_in.TexCoords);
+    // Transparent texels must not write depth. Discarding them before lighting also skips its cost.
+    if (color.a == 0) discard;
     vec3 light = lights.ambientLightColor;
-    for (int directional_i = 0; directional_i < lights.directionalLightCount; ++directional_i) {
+    for (uint directional_i = 0; directional_i < DIR_LIGHT_COUNT; ++directional_i) {
         vec4 FragPosLightSpace = lights.directionalLights[directional_i].lightSpaceMatrix * vec4(fs_in.FragPos, 1.0);
         vec3 light_forward = normalize(lights.directionalLights[directional_i].lightSpaceMatrix[2].xyz);
         // Assume our normal is always facing the camera
@@ -85,21 +129,29 @@ void main() {
             (1.0 - ShadowCalculation(lights.directionalLights[directional_i].lightAtlasPos.xy,
             lights.directionalLights[directional_i].lightAtlasPos.z, FragPosLightSpace));
     }
-    for (int point_i = 0; point_i < lights.pointLightCount; ++point_i) {
-        vec4 FragPosLightSpace = lights.pointLights[point_i].lightSpaceMatrix * vec4(fs_in.FragPos, 1.0);
-        vec3 light_pos = lights.pointLights[point_i].pos;
+#if POINT_LIGHTS
+    // Only the point lights that reach this fragment's tile can light it.
+    uvec2 tile = min(uvec2(gl_FragCoord.xy) / lights.tileSize, lights.tileCount - 1);
+    uint tile_i = tile.y * lights.tileCount.x + tile.x;
+    uint first_light = lightGrid[tile_i * 2];
+    uint tile_light_count = lightGrid[tile_i * 2 + 1];
+    for (uint list_i = 0; list_i < tile_light_count; ++list_i) {
+        PointLight point_light = pointLights[lightGrid[first_light + list_i]];
+        vec3 light_pos = point_light.pos;
+        float light_distance = distance(light_pos, fs_in.FragPos);
+        if (light_distance >= point_light.radius) continue;
         vec3 light_dir_vec = normalize(light_pos - fs_in.FragPos);
         // Assume our normal is always facing the camera
         vec3 this_normal = vec3(0, 0, 1);
-        float light_strength = dot(this_normal, light_dir_vec) * lights.pointLights[point_i].color.a;
-        light_strength *= min(1.0, (lights.pointLights[point_i].radius - distance(light_pos, fs_in.FragPos)) / lights.pointLights[point_i].radius);
+        float light_strength = dot(this_normal, light_dir_vec) * point_light.color.a;
+        light_strength *= min(1.0, (point_light.radius - light_distance) / point_light.radius);
         light_strength = max(light_strength, 0.0);
-        light += light_strength * lights.pointLights[point_i].color.rgb *
-        (1.0 - ShadowCalculation(lights.pointLights[point_i].lightAtlasPos.xy,
-        lights.pointLights[point_i].lightAtlasPos.z, FragPosLightSpace));
+        if (light_strength == 0.0) continue;
+        vec4 FragPosLightSpace = point_light.lightSpaceMatrix * vec4(fs_in.FragPos, 1.0);
+        light += light_strength * point_light.color.rgb *
+        (1.0 - ShadowCalculation(point_light.lightAtlasPos.xy,
+        point_light.lightAtlasPos.z, FragPosLightSpace));
     }
-    FragColor = texture(tile, fs_in.TexCoords).rgba * vec4(light, 1.0);
-    if (texture(tile, fs_in.TexCoords).a == 0) { gl_FragDepth = 99999; return; }
-
-    gl_FragDepth = gl_FragCoord.z;
+#endif
+    FragColor = color * fs_in.Tint * vec4(light, 1.0);
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #version 450 core
 
-in vec3 iPos;
-in vec2 iTexCoords;
+layout(location = 0) in vec3 iPos;
+layout(location = 1) in vec2 iTexCoords;
+// Per-instance data. Commands that aren't instanced get a zero offset and a white tint.
+layout(location = 2) in vec3 iInstanceOffset;
+layout(location = 3) in vec4 iInstanceTint;
 
 layout(location = 0) uniform mat4 model;
 layout(location = 1) uniform mat4 projection;
@@ -10,11 +13,15 @@ layout(location = 2) uniform mat4 view;
 out VS_OUT {
     vec3 FragPos;
     vec2 TexCoords;
+    vec4 Tint;
 } vs_out;
+// Must match the depth prepass exactly. See depth.vert.
+invariant gl_Position;
 
 void main()
 {
-    vs_out.FragPos = vec3(model * vec4(iPos, 1.0));
+    vs_out.FragPos = vec3(model * vec4(iPos + iInstanceOffset, 1.0));
     vs_out.TexCoords = iTexCoords;
+    vs_out.Tint = iInstanceTint;
     gl_Position = projection * view * vec4(vs_out.FragPos, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,16 @@
+# Generates a source file with the contents of every shader in assets/, so that the built-in shaders
+# can be loaded without reading files at runtime. The shaders are read when configuring, and editing
+# any of them makes CMake configure again.
+function(aryibi_embed_shaders OUTPUT)
+    file(GLOB SHADER_FILES CONFIGURE_DEPENDS
+            ${aryibi_SOURCE_DIR}/assets/*.vert ${aryibi_SOURCE_DIR}/assets/*.frag)
+    set(ARYIBI_EMBEDDED_SHADERS "")
+    foreach (SHADER_FILE ${SHADER_FILES})
+        get_filename_component(SHADER_NAME ${SHADER_FILE} NAME)
+        file(READ ${SHADER_FILE} SHADER_SOURCE)
+        string(APPEND ARYIBI_EMBEDDED_SHADERS
+                "    {\"${SHADER_NAME}\", R\"aryibi_shader(${SHADER_SOURCE})aryibi_shader\"},\n")
+    endforeach ()
+    set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS ${SHADER_FILES})
+    configure_file(${aryibi_SOURCE_DIR}/src/renderer/opengl/embedded_shaders.cpp.in ${OUTPUT} @ONLY)
+endfunction()
@@ -0,0 +1,61 @@
+#ifndef ARYIBI_PALETTE_QUANTIZER_HPP
+#define ARYIBI_PALETTE_QUANTIZER_HPP
+
+#include "renderer.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace aryibi::renderer {
+
+/// Converts RGBA images to the data used by ColorType::indexed_palette textures, by replacing each
+/// pixel with the closest shade of a ColorPalette. This is what TextureHandle::from_file_indexed
+/// uses, but it doesn't need a rendering context, so it can also be used to convert images offline.
+class PaletteQuantizer {
+public:
+    /// An indexed pixel, laid out as it is stored in indexed_palette textures. Both indices start
+    /// at 1, since {0, 0} is reserved for transparent pixels.
+    struct Index {
+        u8 shade;
+        u8 color;
+    };
+    static_assert(sizeof(Index) == 2);
+
+    /// The palette must have at most 255 colors with at most 255 shades each.
+    explicit PaletteQuantizer(ColorPalette const& palette);
+
+    /// @returns The shade of the palette that is the closest to `color`, comparing all four
+    /// channels. When several shades are equally close, the one that comes first in the palette
+    /// wins. Pixels with zero alpha, and every pixel if the palette is empty, are transparent.
+    [[nodiscard]] Index quantize(Color color) const;
+    /// Quantizes a whole image.
+    /// @param rgba width * height pixels, 4 bytes each, row by row.
+    /// @param result Where to write the width * height indexed pixels, in the same order.
+    /// @param thread_count How many threads to use. 0 means as many as hardware threads.
+    void quantize(const u8* rgba, u32 width, u32 height, Index* result, u32 thread_count = 0) const;
+    [[nodiscard]] std::vector<Index>
+    quantize(const u8* rgba, u32 width, u32 height, u32 thread_count = 0) const;
+
+    /// @returns True if every index of the palette can be stored with pack().
+    [[nodiscard]] bool fits_packed() const { return fits_packed_format; }
+    /// @returns The index as stored in indexed_palette_packed textures: The shade index in the low
+    /// nibble and the color index in the high nibble.
+    [[nodiscard]] static u8 pack(Index index) {
+        return static_cast<u8>((index.color << 4u) | index.shade);
+    }
+
+    /// @returns How many different shades the palette has.
+    [[nodiscard]] std::size_t shade_count() const { return indices.size(); }
+
+private:
+    /// Every shade of the palette, with its channels split in separate arrays so that distances
+    /// to all of them can be computed in a single vectorizable loop. Shades are stored in palette
+    /// order: By color, then by shade.
+    std::vector<i32> reds, greens, blues, alphas;
+    std::vector<Index> indices;
+    bool fits_packed_format = true;
+};
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_PALETTE_QUANTIZER_HPP
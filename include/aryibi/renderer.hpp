@@ -8,8 +8,11 @@
 #include <anton/math/vector3.hpp>
 #include <anton/math/vector4.hpp>
 #include <filesystem>
+#include <functional>
+#include <future>
 #include <limits>
 #include <memory>
+#include <string>
 #include <vector>
 
 struct GLFWwindow;
@@ -24,21 +27,26 @@ namespace aryibi::renderer {
 using namespace anton; // For integer types
 
 class Renderer;
+class TextureLoad;
 struct ColorPalette;
 
+/// All handles (TextureHandle, Framebuffer, MeshHandle and ShaderHandle) are small, trivially
+/// copyable values: Copying a handle doesn't copy the object underneath nor allocate any memory, and
+/// destroying a handle doesn't destroy the object. Remember to call unload() on one of the copies if
+/// you want to actually destroy it. Other copies of the handle won't be notified of that, so using
+/// them afterwards is an error.
 class TextureHandle {
 public:
-    enum class ColorType { rgba, indexed_palette, depth };
+    /// indexed_palette textures store a shade and a color index for each pixel, in the format
+    /// returned by PaletteQuantizer. indexed_palette_packed textures take half the memory by
+    /// storing them as the low and high nibbles of a single byte, which limits palettes to 15
+    /// colors of up to 15 shades each.
+    enum class ColorType { rgba, indexed_palette, depth, indexed_palette_packed };
     enum class FilteringMethod { point, linear };
     /// Doesn't actually create a texture -- If exists() is called before
     /// initializing it, it will return false. Call init() to initialize and
     /// create the texture.
-    TextureHandle();
-    /// The destructor will NOT unload the texture underneath. Remember to call
-    /// unload() first if you want to actually destroy the texture.
-    ~TextureHandle();
-    TextureHandle(TextureHandle const&);
-    TextureHandle& operator=(TextureHandle const&);
+    TextureHandle() = default;
 
     /// IMPORTANT: This function will assert if called when a previous texture
     /// existed in this slot. Remember to call unload() first if you want to
@@ -75,38 +83,77 @@ public:
     static TextureHandle from_file_rgba(std::filesystem::path const&,
                                         FilteringMethod filter = FilteringMethod::point,
                                         bool flip = false);
+    /// Loads a texture from a file path like from_file_rgba does, and converts it to an indexed
+    /// texture by replacing each pixel with the closest shade of the palette. The packed format is
+    /// used if the palette is small enough for it.
     static TextureHandle from_file_indexed(std::filesystem::path const&,
                                            ColorPalette const&,
                                            FilteringMethod filter,
                                            bool flip);
+    /// Start loading a texture like from_file_rgba() and from_file_indexed() do, but return
+    /// immediately. Files are decoded by a pool of worker threads and uploaded by the renderer's
+    /// loader thread. Without one, they're uploaded at the start of each frame instead, spending at
+    /// most the time set with Renderer::set_texture_upload_budget() on it.
+    static TextureLoad from_file_rgba_async(std::filesystem::path const&,
+                                            FilteringMethod filter = FilteringMethod::point,
+                                            bool flip = false);
+    static TextureLoad from_file_indexed_async(std::filesystem::path const&,
+                                               ColorPalette const&,
+                                               FilteringMethod filter,
+                                               bool flip);
 
 private:
     friend class Renderer;
     friend class Framebuffer;
     friend class RenderMapContext;
     friend class RenderTilesetContext;
+    friend class TextureAtlas;
     friend bool operator==(TextureHandle const&, TextureHandle const&);
     friend bool operator!=(TextureHandle const&, TextureHandle const&);
-
-    struct impl;
-    std::unique_ptr<impl> p_impl;
+    friend struct std::hash<TextureHandle>;
+
+    /// Backend-defined identifier of the texture. 0 means there is no texture.
+    u32 id = 0;
+    u32 w = 0;
+    u32 h = 0;
+    ColorType type = ColorType::rgba;
+    FilteringMethod filtering = FilteringMethod::point;
 };
 
 /// Compares the internal handle.
 bool operator==(TextureHandle const&, TextureHandle const&);
 inline bool operator!=(TextureHandle const& a, TextureHandle const& b) { return !(a == b); }
 
+/// A texture being loaded in the background. See TextureHandle::from_file_rgba_async(). Like
+/// handles, this is a small value that can be copied freely, but the texture can only be taken out
+/// of one of the copies.
+class TextureLoad {
+public:
+    TextureLoad() = default;
+
+    /// @returns True if the load has been started and the texture hasn't been taken out yet.
+    [[nodiscard]] bool exists() const;
+    /// @returns True if the texture has been uploaded and can be used, or if loading it failed.
+    /// Doesn't touch the GPU, so it can be called from any thread.
+    [[nodiscard]] bool ready() const;
+    /// Waits until the file has been decoded, uploads it right away if the renderer hasn't yet, and
+    /// returns the texture, which won't exist if it couldn't be loaded. The load stops existing
+    /// afterwards. Must be called on the thread that draws, since it may upload the texture.
+    TextureHandle get() const;
+
+private:
+    friend class TextureHandle;
+
+    /// Backend-defined identifier of the load. 0 means there is no load.
+    u32 id = 0;
+};
+
 /// A handle to a generic framebuffer with a texture attached to it.
 /// TODO: Rename to FramebufferHandle for consistency
 class Framebuffer {
 public:
-    Framebuffer();
+    Framebuffer() = default;
     explicit Framebuffer(TextureHandle const& texture);
-    /// The destructor should NOT destroy the underlying framebuffer/handle. It is
-    /// just put here so that the implementation links correctly.
-    ~Framebuffer();
-    Framebuffer(Framebuffer const&);
-    Framebuffer& operator=(Framebuffer const&);
 
     bool exists() const;
     void unload();
@@ -119,19 +166,49 @@ private:
     friend class RenderMapContext;
     friend class RenderTilesetContext;
 
-    struct impl;
-    std::unique_ptr<impl> p_impl;
+    /// Attaches the texture to the framebuffer and clears it.
+    void attach_texture();
+
+    /// Backend-defined identifier of the framebuffer. -1 means there is no framebuffer.
+    u32 id = static_cast<u32>(-1);
+    TextureHandle tex;
+};
+
+/// The layout used to store mesh vertices in GPU memory.
+enum class VertexFormat {
+    /// 32-bit float positions and UVs. 20 bytes per vertex.
+    full,
+    /// Half float positions and 16-bit normalized UVs. 12 bytes per vertex. Positions must be
+    /// representable as half floats with an error under 1/4096 tiles (Which is the case for tile
+    /// grids up to 1024 tiles wide with half tile precision) and UVs must be within [0, 1]. If any
+    /// vertex doesn't meet these requirements, the mesh will use the full format instead.
+    compact
+};
+
+class MeshBuilder;
+
+/// An axis-aligned bounding box. The default one is empty (Contains nothing).
+struct AABB {
+    anton::math::Vector3 min{std::numeric_limits<float>::infinity(),
+                             std::numeric_limits<float>::infinity(),
+                             std::numeric_limits<float>::infinity()};
+    anton::math::Vector3 max{-std::numeric_limits<float>::infinity(),
+                             -std::numeric_limits<float>::infinity(),
+                             -std::numeric_limits<float>::infinity()};
+
+    [[nodiscard]] bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+};
+
+/// A range of consecutive quads in a mesh or mesh builder. Every sprite piece is a single quad.
+struct QuadRange {
+    u32 first = 0;
+    u32 count = 0;
 };
 
 struct MeshHandle {
     /// Meshes are only meant to be created by MeshBuilder. Otherwise you won't be
     /// able to put data in them.
-    MeshHandle();
-    /// The MeshHandle destructor won't actually unload the underlying mesh. Use
-    /// unload() for that.
-    ~MeshHandle();
-    MeshHandle(MeshHandle const&);
-    MeshHandle& operator=(MeshHandle const&);
+    MeshHandle() = default;
 
     /// Returns true if the texture exists and has not been unloaded.
     [[nodiscard]] bool exists() const;
@@ -139,29 +216,85 @@ struct MeshHandle {
     /// unloaded previously.
     void unload();
 
+    /// @returns How many quads the mesh has.
+    [[nodiscard]] u32 quad_count() const;
+    /// @returns How many quads the mesh can hold without being recreated. See MeshBuilder::finish.
+    [[nodiscard]] u32 quad_capacity() const;
+    /// @returns The bounds of the mesh vertices, in mesh units. Used by the renderer to skip
+    /// meshes that aren't visible. Removing quads doesn't shrink the bounds.
+    [[nodiscard]] AABB bounds() const;
+
+    /// Overwrites quads in the mesh with all the quads added to a builder, and resets the builder.
+    /// Only the data that changed is uploaded.
+    /// IMPORTANT: [first_quad, first_quad + amount of quads in the builder) must be within
+    /// quad_count(). If the mesh uses the compact vertex format, the new quads must fit in it.
+    void write_quads(u32 first_quad, MeshBuilder const& quads);
+    /// Adds all the quads in a builder to the end of the mesh, and resets the builder.
+    /// IMPORTANT: The mesh must have enough spare capacity for them. If the mesh uses the compact
+    /// vertex format, the new quads must fit in it.
+    /// @returns Where the quads were placed in the mesh.
+    QuadRange append_quads(MeshBuilder const& quads);
+    /// Removes a range of quads from the mesh. To avoid moving the whole mesh, the gap is filled
+    /// with the quads at the end of the mesh, so those will change position.
+    /// @returns The range the quads that were moved to range.first were at before removing.
+    QuadRange remove_quads(QuadRange range);
+
 private:
     friend class MeshBuilder;
     friend class Renderer;
+    friend struct std::hash<MeshHandle>;
+
+    /// Backend-defined identifier of the mesh. 0 if the mesh doesn't exist.
+    u32 id = 0;
+    /// Where the quads of the mesh start in the vertex storage shared by every mesh.
+    u32 first_storage_quad = 0;
+    u32 max_quads = 0;
+    VertexFormat format = VertexFormat::full;
+    // The quad count and bounds change when quads are added or removed, so they're kept by the
+    // backend, where every copy of the handle sees the same values.
+};
 
-    struct impl;
-    std::unique_ptr<impl> p_impl;
+/// A preprocessor definition added to a shader, as `#define name value`.
+struct ShaderDefine {
+    std::string name;
+    std::string value = "1";
+};
+
+/// Statistics about the on-disk program binary cache, accumulated since the program started.
+struct ShaderCacheStats {
+    /// Programs loaded from the cache.
+    u32 hits = 0;
+    /// Programs compiled because they weren't in the cache, or their entry was stale.
+    u32 misses = 0;
+    /// Time saved by the hits: The time it took to compile and link them when they were added to
+    /// the cache, minus the time it took to load them.
+    double seconds_saved = 0;
 };
 
-/// Represents a GLSL shader handle. A regular shader must have the following
-/// structure: Vertex shader: in vec3 iPos; in vec2 iTexCoords; layout(location
-/// = 0) uniform mat4 model; layout(location = 1) uniform mat4 projection;
-/// layout(location = 2) uniform mat4 view;
-/// layout(location = 3) uniform mat4 lightSpaceMatrix; // If lighting is
-/// needed. Optional Fragment shader: uniform sampler2D tile;     // MUST have
-/// this name uniform sampler2D shadow;   // MUST have this name, if lighting is
-/// needed. Optional
+/// Represents a GLSL shader handle. A regular shader must have the following structure:
+/// - Vertex shader:
+///   - layout(location = 0) in vec3 iPos;
+///   - layout(location = 1) in vec2 iTexCoords;
+///   - layout(location = 2) in vec3 iInstanceOffset; // Must be added to iPos
+///   - layout(location = 3) in vec4 iInstanceTint; // Optional
+///   - layout(location = 0) uniform mat4 model;
+///   - layout(location = 1) uniform mat4 projection;
+///   - layout(location = 2) uniform mat4 view;
+///   - layout(location = 3) uniform mat4 lightSpaceMatrix; // Optional, if lighting is needed
+/// - Fragment shader:
+///   - uniform sampler2D tile; // MUST have this name
+///   - uniform sampler2DShadow shadow; // MUST have this name. Optional, if lighting is needed
+///
+/// Shaders can be loaded with defines, which are inserted right after the #version line of both
+/// stages and followed by a #line directive, so that compile errors still point to the right line
+/// of the original source. variant() compiles the same sources with more defines. Lit shaders
+/// (Those with a shadow sampler) are drawn with a variant specialized on the lights of each frame,
+/// with SHADOW_QUALITY, POINT_LIGHTS and, if there are few directional lights,
+/// DIRECTIONAL_LIGHT_COUNT defined. See assets/shaded_tile.frag.
 struct ShaderHandle {
     /// Creates a blank shader handle. Does not really have an use outside of the
     /// renderer implementation.
-    ShaderHandle();
-    ~ShaderHandle();
-    ShaderHandle(ShaderHandle const&);
-    ShaderHandle& operator=(ShaderHandle const&);
+    ShaderHandle() = default;
 
     /// Returns true if the shader exists and has not been unloaded.
     [[nodiscard]] bool exists() const;
@@ -170,15 +303,48 @@ struct ShaderHandle {
     void unload();
 
     /// Loads a GLSL shader from two paths (One for the fragment shader and
-    /// another one for the vertex one)
+    /// another one for the vertex one), with the given defines.
     static ShaderHandle from_file(std::filesystem::path const& vert_path,
-                                  std::filesystem::path const& frag_path);
+                                  std::filesystem::path const& frag_path,
+                                  std::vector<ShaderDefine> const& defines = {});
+    /// Same as from_file(), but taking the GLSL source code of each stage directly.
+    static ShaderHandle from_source(std::string const& vert_source,
+                                    std::string const& frag_source,
+                                    std::vector<ShaderDefine> const& defines = {});
+    /// Start loading a shader like from_file() and from_source() do, but return without waiting
+    /// for the driver to compile it, so that it can be done in the background if supported. The
+    /// shader must not be used until ready() returns true.
+    static ShaderHandle from_file_async(std::filesystem::path const& vert_path,
+                                        std::filesystem::path const& frag_path,
+                                        std::vector<ShaderDefine> const& defines = {});
+    static ShaderHandle from_source_async(std::string const& vert_source,
+                                          std::string const& frag_source,
+                                          std::vector<ShaderDefine> const& defines = {});
+    /// @returns True if the shader has finished compiling and can be used. Always true for shaders
+    /// not loaded asynchronously. Throws std::runtime_error if compiling it failed.
+    [[nodiscard]] bool ready() const;
+    /// Waits until the shader has finished compiling. Throws std::runtime_error if it failed.
+    void wait() const;
+    /// @returns This shader compiled with additional defines. Variants start compiling the first
+    /// time they're requested, like from_source_async() does, so check ready() before using them.
+    /// They're kept until this shader is unloaded, which unloads them as well, so they shouldn't be
+    /// unloaded on their own. If compiling a variant failed, requesting it again returns a handle
+    /// that doesn't exist.
+    [[nodiscard]] ShaderHandle variant(std::vector<ShaderDefine> const& defines) const;
+
+    /// Enables caching linked programs in a directory, which is created if needed, so that they
+    /// don't have to be compiled again the next time they're loaded. Entries are keyed by the
+    /// sources, defines and driver, and outdated ones are replaced. An empty path disables the
+    /// cache, which is the default.
+    static void set_binary_cache_directory(std::filesystem::path const& directory);
+    [[nodiscard]] static ShaderCacheStats binary_cache_stats();
 
 private:
     friend class Renderer;
+    friend struct std::hash<ShaderHandle>;
 
-    struct impl;
-    std::unique_ptr<impl> p_impl;
+    /// Backend-defined identifier of the shader. 0 means there is no shader.
+    u32 id = 0;
 };
 
 /// Represents a RGBA 32-bit color.
@@ -239,9 +405,38 @@ struct DrawCmd {
     ShaderHandle shader;
     Transform transform;
     bool cast_shadows = false;
+    /// Set for partially transparent textures, which are drawn after everything else, furthest
+    /// first, without writing depth. Otherwise texels are either fully opaque or fully transparent.
+    bool translucent = false;
+};
+
+/// Per-instance data of an InstancedDrawCmd.
+struct Instance {
+    /// Added to the position of the command transform.
+    anton::math::Vector3 offset;
+    /// The color the instance is multiplied by.
+    Color tint = colors::white;
+};
+
+/// Draws the same mesh once for each instance, all in a single draw call. Much cheaper than
+/// submitting a DrawCmd for each copy when there are lots of identical sprites.
+struct InstancedDrawCmd {
+    TextureHandle texture;
+    MeshHandle mesh;
+    ShaderHandle shader;
+    Transform transform;
+    std::vector<Instance> instances;
+    bool cast_shadows = false;
+    /// See DrawCmd::translucent. Instances aren't sorted between themselves.
+    bool translucent = false;
 };
 
 struct Light {
+    /// How important the shadows of this light are. Lights get a part of the shadow atlas
+    /// proportional to their priority and to how much of the screen they light. Lights with a
+    /// priority of 0 don't cast shadows.
+    float shadow_priority = 1;
+
 private:
     friend class Renderer;
     /// The position within the light atlas, in UV coordinates.
@@ -264,14 +459,58 @@ struct PointLight : Light {
     float intensity;
 };
 
+/// How shadows are filtered by the lit shaders. Higher qualities are smoother but more expensive.
+enum class ShadowQuality {
+    /// No shadows. Shadow maps aren't drawn at all.
+    off,
+    /// A single depth comparison per light, which gives blocky shadow edges.
+    hard,
+    /// Averages 2x2 depth comparisons, fetched at once.
+    pcf2x2,
+    /// Averages 5x5 depth comparisons, fetched four at a time. The default.
+    pcf5x5
+};
+
+/// The order in which the commands of a DrawCmdList are drawn.
+enum class DrawOrder {
+    /// Group commands with the same shader, texture and mesh together to minimize state changes,
+    /// drawing the closest ones first within each group. The default.
+    state,
+    /// Draw the furthest commands first so that translucent pixels blend correctly. Commands at
+    /// the same depth are grouped by state.
+    back_to_front,
+    /// Draw commands in the same order they were added to the list.
+    submission
+};
+
 struct DrawCmdList {
     Camera camera;
     std::vector<DrawCmd> commands;
+    DrawOrder order = DrawOrder::state;
+    /// Drawn after every command in `commands`, in the same order they were added.
+    std::vector<InstancedDrawCmd> instanced_commands;
     std::vector<DirectionalLight> directional_lights;
     std::vector<PointLight> point_lights;
     Color ambient_light_color = colors::black;
 };
 
+/// Size information about the data accumulated in a MeshBuilder.
+struct MeshStats {
+    /// The vertex format the mesh will actually use.
+    VertexFormat format = VertexFormat::full;
+    /// How many quads (sprite pieces) the mesh has.
+    u64 quad_count = 0;
+    /// How many unique vertices are stored for the mesh.
+    u64 vertex_count = 0;
+    /// Size of the vertex data, in bytes.
+    u64 vertex_bytes = 0;
+    /// Vertices that would have been stored if every quad was made out of two separate triangles.
+    u64 saved_vertex_count = 0;
+    /// Bytes saved by indexing, after accounting for the index data. The index buffer is shared by
+    /// every mesh, so this is usually the same as the vertex bytes saved.
+    u64 saved_bytes = 0;
+};
+
 class MeshBuilder {
 public:
     MeshBuilder();
@@ -286,17 +525,52 @@ public:
     /// axis per Y unit.
     /// @param horizontal_slope How many tile units to distort the sprite in the Z
     /// axis per X unit.
-    void add_sprite(sprites::Sprite const& spr,
-                    anton::math::Vector3 offset,
-                    float vertical_slope = 0,
-                    float horizontal_slope = 0,
-                    float z_min = std::numeric_limits<float>::min(),
-                    float z_max = std::numeric_limits<float>::max());
+    /// @returns The quads the sprite pieces were placed at, in the same order. Keep this around
+    /// to update the sprite later on with MeshHandle::write_quads.
+    QuadRange add_sprite(sprites::Sprite const& spr,
+                         anton::math::Vector3 offset,
+                         float vertical_slope = 0,
+                         float horizontal_slope = 0,
+                         float z_min = std::numeric_limits<float>::min(),
+                         float z_max = std::numeric_limits<float>::max());
+
+    /// Appends all the data from another builder to this one.
+    void append(MeshBuilder const& other);
+
+    /// Builds part of the mesh out of independent chunks (e.g. map chunks or ranges of sprites)
+    /// using several threads. `build_chunk` is called once for every chunk index in
+    /// [0, chunk_count), with an empty MeshBuilder that it should add that chunk's sprites to.
+    /// The chunks are then appended to this builder in chunk index order, so the result is exactly
+    /// the same as building them one after another, no matter how the work was distributed.
+    /// This doesn't need a rendering context, only finish() does.
+    /// @param build_chunk Called from several threads at once. It must only touch the builder it
+    /// has been given.
+    /// @param thread_count How many threads to use. 0 means as many as hardware threads.
+    /// @returns The quads each chunk was placed at. Quad ranges returned by add_sprite calls within
+    /// a chunk are relative to its first quad.
+    std::vector<QuadRange> add_chunks_parallel(
+        std::size_t chunk_count,
+        std::function<void(MeshBuilder& chunk_builder, std::size_t chunk_index)> const& build_chunk,
+        u32 thread_count = 0);
+
+    /// @returns Size information about the mesh that finish(format) would return right now.
+    [[nodiscard]] MeshStats stats(VertexFormat format = VertexFormat::full) const;
+    /// @returns The vertices added until now, as VertexFormat::full lays them out: 3 position
+    /// floats followed by 2 UV floats for each vertex, and 4 vertices for each quad. This is the
+    /// data finish() uploads.
+    [[nodiscard]] std::vector<float> const& vertices() const;
 
     /// Returns a mesh with the data added until now and resets the meshbuilder's internal state.
-    [[nodiscard]] MeshHandle finish() const;
+    /// @param format The vertex format to use. If the compact format is requested but the data
+    /// doesn't fit in it, the full format will be used instead.
+    /// @param quad_capacity How many quads to allocate space for, so that more quads can be
+    /// appended to the mesh later on. If smaller than the amount of quads added, it is ignored.
+    [[nodiscard]] MeshHandle finish(VertexFormat format = VertexFormat::full,
+                                    u32 quad_capacity = 0) const;
 
 private:
+    friend struct MeshHandle;
+
     struct impl;
     std::unique_ptr<impl> p_impl;
 };
@@ -313,6 +587,36 @@ struct ColorPalette {
     Color transparent_color = 0;
 };
 
+/// Statistics about a single Renderer::draw call.
+struct RenderStats {
+    /// Commands drawn in the main pass.
+    u32 commands_submitted = 0;
+    /// Commands skipped in the main pass because they were outside the camera view.
+    u32 commands_culled = 0;
+    /// Instances drawn by instanced commands in all passes.
+    u32 instances_submitted = 0;
+    /// Shadow caster draws submitted, summed over all lights.
+    u32 shadow_casters_submitted = 0;
+    /// Shadow caster draws skipped because they were outside the light view, summed over all
+    /// lights.
+    u32 shadow_casters_culled = 0;
+    /// Lights whose shadow map was drawn, and lights whose shadow map was kept from a previous
+    /// draw because neither the light nor the casters inside its view changed.
+    u32 shadow_maps_rendered = 0;
+    u32 shadow_maps_reused = 0;
+    /// Shadow casters drawn for each light, directional lights first. Only casters that are inside
+    /// the light view (And radius, for point lights) are drawn.
+    std::vector<u32> shadow_casters_per_light;
+    /// How many times the shader, texture and vertex array used for drawing were changed,
+    /// including the shadow passes. Meshes with the same vertex format share a vertex array.
+    u32 shader_changes = 0;
+    u32 texture_changes = 0;
+    u32 vertex_array_changes = 0;
+    /// Draw calls issued in all passes. Consecutive commands with the same shader, texture and
+    /// vertex format are drawn together with a single call.
+    u32 draw_calls = 0;
+};
+
 class Renderer {
 public:
     /// Create and initialize a renderer bound to a valid window. No more than one renderer can be
@@ -320,10 +624,45 @@ public:
     explicit Renderer(windowing::WindowHandle parent_window);
     ~Renderer();
 
+    /// Draws a list of commands. Commands whose meshes are outside the camera view are skipped, as
+    /// well as shadow casters outside of each light's view or radius.
     void draw(DrawCmdList const& draw_commands, Framebuffer const& output_fb);
+    /// @returns Statistics about the last draw() call.
+    [[nodiscard]] RenderStats const& last_draw_stats() const;
     void clear(Framebuffer& fb, anton::math::Vector4 color);
 
+    /// Sets the size of the shadow atlas, which is shared by the shadow maps of every light.
     void set_shadow_resolution(u32 width, u32 height);
+    /// Enables or disables drawing the shadow maps of several lights in a single pass over their
+    /// shadow casters. Requires GL_ARB_shader_viewport_layer_array, and is enabled by default if
+    /// available. Otherwise, shadow maps are drawn one light at a time.
+    void set_single_pass_shadows(bool enabled);
+    [[nodiscard]] bool single_pass_shadows_supported() const;
+    /// Enables or disables drawing the depth of every opaque command before drawing them for real,
+    /// so that their shaders only run once for each pixel. Worth it when expensive shaders
+    /// overlap a lot. Disabled by default. Custom vertex shaders must compute gl_Position as
+    /// `projection * view * vec4(vec3(model * vec4(iPos + iInstanceOffset, 1.0)), 1.0)` and
+    /// declare it invariant, like the built-in ones, or their depth won't match the prepass.
+    void set_depth_prepass(bool enabled);
+    /// Sets how much time start_frame() can spend uploading textures loaded asynchronously,
+    /// in milliseconds. At least one texture is uploaded on each frame if any is waiting. Defaults
+    /// to 2 milliseconds.
+    void set_texture_upload_budget(float milliseconds);
+    /// @returns True if the renderer has a loader thread. See load_in_background().
+    [[nodiscard]] bool background_loading_supported() const;
+    /// Runs a job on the loader thread, which has an OpenGL context that shares objects with the
+    /// one used for drawing. Jobs run one after another, in the order they were given. They can
+    /// create and load textures (With TextureHandle::init() and from_file_*()), but not meshes,
+    /// shaders nor framebuffers. Asynchronous texture loads are uploaded from this thread as well
+    /// instead of during start_frame(). If there's no loader thread, the job is run right away.
+    /// @returns A future that becomes ready once the job has returned and the GPU has finished
+    /// executing everything it issued, so that the textures it loaded can be drawn. get() rethrows
+    /// any exception thrown by the job.
+    std::future<void> load_in_background(std::function<void()> job);
+    /// Sets how shadows are filtered by lit shaders. Shaders can check SHADOW_QUALITY, which is
+    /// defined to the index of the quality in ShadowQuality.
+    void set_shadow_quality(ShadowQuality quality);
+    [[nodiscard]] ShadowQuality get_shadow_quality() const;
     [[nodiscard]] anton::math::Vector2 get_shadow_resolution() const;
     void set_palette(ColorPalette const&);
 
@@ -350,8 +689,6 @@ private:
 
 } // namespace aryibi::renderer
 
-#include <functional>
-
 namespace std {
 
 template<> struct hash<aryibi::renderer::TextureHandle> {
@@ -0,0 +1,59 @@
+#ifndef ARYIBI_TEXTURE_ATLAS_HPP
+#define ARYIBI_TEXTURE_ATLAS_HPP
+
+#include "renderer.hpp"
+#include "sprites.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace aryibi::renderer {
+
+/// Packs many small images into a few big textures (Pages), so that sprites using different
+/// images can be drawn without changing the bound texture. Images are added one at a time and
+/// never moved afterwards, so the chunks returned stay valid as more images are added. A new page
+/// is created whenever an image doesn't fit in the existing ones.
+class TextureAtlas {
+public:
+    /// @param type The color type of every page. Images added must have this same type. Depth
+    /// textures aren't supported.
+    /// @param filter The filtering method of every page.
+    /// @param page_size The width and height of each page, in pixels.
+    /// @param padding Pixels left around each image, filled by repeating its edges, so that
+    /// linear filtering doesn't bleed neighbouring images into it.
+    explicit TextureAtlas(
+        TextureHandle::ColorType type = TextureHandle::ColorType::rgba,
+        TextureHandle::FilteringMethod filter = TextureHandle::FilteringMethod::point,
+        u32 page_size = 2048,
+        u32 padding = 1);
+    TextureAtlas(TextureAtlas const&) = delete;
+    TextureAtlas& operator=(TextureAtlas const&) = delete;
+    TextureAtlas(TextureAtlas&&) noexcept;
+    TextureAtlas& operator=(TextureAtlas&&) noexcept;
+    /// Doesn't unload the pages, like handles. Call unload() for that.
+    ~TextureAtlas();
+
+    /// Adds an image to the atlas.
+    /// @param data width * height pixels, row by row, in the format the atlas' color type uses
+    /// (4 bytes per pixel for RGBA, and as returned by PaletteQuantizer for indexed types).
+    /// @returns The region of the atlas the image was placed in, which can be given to sprite
+    /// solvers just like a chunk of a regular texture. If the image is bigger than a page, the
+    /// chunk returned has no texture.
+    sprites::TextureChunk add(u32 width, u32 height, const void* data);
+    /// Copies a texture to the atlas. The texture must have the atlas' color type, and can be
+    /// unloaded afterwards.
+    sprites::TextureChunk add(TextureHandle const& texture);
+
+    /// @returns Every page created so far.
+    [[nodiscard]] std::vector<TextureHandle> const& pages() const;
+    /// Unloads every page, invalidating every chunk returned, and leaves the atlas empty.
+    void unload();
+
+private:
+    struct impl;
+    std::unique_ptr<impl> p_impl;
+};
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_TEXTURE_ATLAS_HPP
@@ -0,0 +1,246 @@
+#include "renderer/mesh_builder.hpp"
+
+#include "aryibi/sprites.hpp"
+#include "util/parallel_for.hpp"
+
+#include <anton/math/math.hpp>
+
+#include <cmath>
+#include <cstring>
+
+namespace aml = anton::math;
+
+namespace aryibi::renderer {
+
+namespace {
+
+/// Maximum error allowed when storing positions as half floats, in tile units. Small enough to never
+/// be visible, but big enough to accept values like the tiny default z_min of add_sprite.
+constexpr float max_half_position_error = 1.f / 4096.f;
+
+bool fits_in_half(float value) {
+    return std::abs(half_to_float(float_to_half(value)) - value) <= max_half_position_error;
+}
+
+u16 float_to_unorm16(float value) {
+    return static_cast<u16>(std::lround(aml::clamp(value, 0.f, 1.f) * 65535.f));
+}
+
+} // namespace
+
+u16 float_to_half(float value) {
+    u32 bits;
+    std::memcpy(&bits, &value, sizeof(u32));
+    const u32 sign = (bits >> 16u) & 0x8000u;
+    const u32 float_exponent = (bits >> 23u) & 0xFFu;
+    u32 mantissa = bits & 0x7FFFFFu;
+
+    if (float_exponent == 0xFF) // Infinity or NaN
+        return sign | 0x7C00u | (mantissa ? 0x200u : 0u);
+
+    const int exponent = static_cast<int>(float_exponent) - 127 + 15;
+    if (exponent >= 31) // Too big, becomes infinity
+        return sign | 0x7C00u;
+
+    if (exponent <= 0) {
+        // Subnormal half (Or too small, which rounds to zero)
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000u;
+        const u32 shift = 14 - exponent;
+        u32 half_mantissa = mantissa >> shift;
+        const u32 remainder = mantissa & ((1u << shift) - 1u);
+        const u32 halfway = 1u << (shift - 1u);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1u)))
+            ++half_mantissa;
+        return sign | half_mantissa;
+    }
+
+    u32 half = sign | (static_cast<u32>(exponent) << 10u) | (mantissa >> 13u);
+    const u32 remainder = mantissa & 0x1FFFu;
+    // An overflow of the mantissa carries into the exponent, which is exactly what we want.
+    if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u)))
+        ++half;
+    return half;
+}
+
+float half_to_float(u16 half) {
+    const u32 sign = (half & 0x8000u) << 16u;
+    const u32 exponent = (half >> 10u) & 0x1Fu;
+    const u32 mantissa = half & 0x3FFu;
+
+    u32 bits;
+    if (exponent == 0) {
+        // Zero or subnormal
+        const float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -magnitude : magnitude;
+    } else if (exponent == 31) {
+        bits = sign | 0x7F800000u | (mantissa << 13u);
+    } else {
+        bits = sign | ((exponent - 15 + 127) << 23u) | (mantissa << 13u);
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+MeshBuilder::MeshBuilder() : p_impl(std::make_unique<impl>()) { p_impl->result.reserve(256); }
+MeshBuilder::~MeshBuilder() = default;
+MeshBuilder::MeshBuilder(MeshBuilder const& other) : p_impl(std::make_unique<impl>()) {
+    *p_impl = *other.p_impl;
+}
+MeshBuilder& MeshBuilder::operator=(MeshBuilder const& other) {
+    if (this != &other) {
+        *p_impl = *other.p_impl;
+    }
+    return *this;
+}
+
+QuadRange MeshBuilder::add_sprite(sprites::Sprite const& spr,
+                                  aml::Vector3 offset,
+                                  float vertical_slope,
+                                  float horizontal_slope,
+                                  float z_min,
+                                  float z_max) {
+    const auto add_piece = [&](sprites::Sprite::Piece const& piece, std::size_t base_n) {
+        auto& result = p_impl->result;
+        const sprites::Rect2D pos_rect{
+            {piece.destination.start.x + offset.x, piece.destination.start.y + offset.y},
+            {piece.destination.end.x + offset.x, piece.destination.end.y + offset.y}};
+        const sprites::Rect2D uv_rect = piece.source;
+        const sprites::Rect2D z_map{
+            {aml::clamp(piece.destination.start.x * horizontal_slope, z_min, z_max),
+             aml::clamp(piece.destination.start.y * vertical_slope, z_min, z_max)},
+            {aml::clamp(piece.destination.end.x * horizontal_slope, z_min, z_max),
+             aml::clamp(piece.destination.end.y * vertical_slope, z_min, z_max)}};
+
+        // Quads are drawn as two triangles (0, 1, 2) and (1, 3, 2) by QuadIndexBuffer.
+        /* X pos 1st vertex */ result[base_n + 0] = pos_rect.start.x;
+        /* Y pos 1st vertex */ result[base_n + 1] = pos_rect.start.y;
+        /* Z pos 1st vertex */ result[base_n + 2] = z_map.start.x + z_map.start.y + offset.z;
+        /* X UV 1st vertex  */ result[base_n + 3] = uv_rect.start.x;
+        /* Y UV 1st vertex  */ result[base_n + 4] = uv_rect.end.y;
+        /* X pos 2nd vertex */ result[base_n + 5] = pos_rect.end.x;
+        /* Y pos 2nd vertex */ result[base_n + 6] = pos_rect.start.y;
+        /* Z pos 2nd vertex */ result[base_n + 7] = z_map.end.x + z_map.start.y + offset.z;
+        /* X UV 2nd vertex  */ result[base_n + 8] = uv_rect.end.x;
+        /* Y UV 2nd vertex  */ result[base_n + 9] = uv_rect.end.y;
+        /* X pos 3rd vertex */ result[base_n + 10] = pos_rect.start.x;
+        /* Y pos 3rd vertex */ result[base_n + 11] = pos_rect.end.y;
+        /* Z pos 3rd vertex */ result[base_n + 12] = z_map.start.x + z_map.end.y + offset.z;
+        /* X UV 3rd vertex  */ result[base_n + 13] = uv_rect.start.x;
+        /* Y UV 3rd vertex  */ result[base_n + 14] = uv_rect.start.y;
+        /* X pos 4th vertex */ result[base_n + 15] = pos_rect.end.x;
+        /* Y pos 4th vertex */ result[base_n + 16] = pos_rect.end.y;
+        /* Z pos 4th vertex */ result[base_n + 17] = z_map.end.x + z_map.end.y + offset.z;
+        /* X UV 4th vertex  */ result[base_n + 18] = uv_rect.end.x;
+        /* Y UV 4th vertex  */ result[base_n + 19] = uv_rect.start.y;
+
+        for (std::size_t vertex = 0; vertex < vertices_per_quad; ++vertex) {
+            const float* v = result.data() + base_n + vertex * impl::sizeof_vertex;
+            auto& bounds = p_impl->bounds;
+            bounds.min = {aml::min(bounds.min.x, v[0]), aml::min(bounds.min.y, v[1]),
+                          aml::min(bounds.min.z, v[2])};
+            bounds.max = {aml::max(bounds.max.x, v[0]), aml::max(bounds.max.y, v[1]),
+                          aml::max(bounds.max.z, v[2])};
+        }
+
+        if (p_impl->fits_compact) {
+            for (std::size_t vertex = 0; vertex < vertices_per_quad; ++vertex) {
+                const float* v = result.data() + base_n + vertex * impl::sizeof_vertex;
+                if (!fits_in_half(v[0]) || !fits_in_half(v[1]) || !fits_in_half(v[2]) ||
+                    v[3] < 0 || v[3] > 1 || v[4] < 0 || v[4] > 1) {
+                    p_impl->fits_compact = false;
+                    break;
+                }
+            }
+        }
+    };
+
+    const auto prev_size = p_impl->result.size();
+    p_impl->result.resize(prev_size + spr.pieces.size() * impl::sizeof_quad);
+    for (std::size_t i = 0; i < spr.pieces.size(); ++i) {
+        add_piece(spr.pieces[i], prev_size + i * impl::sizeof_quad);
+    }
+    return {static_cast<u32>(prev_size / impl::sizeof_quad), static_cast<u32>(spr.pieces.size())};
+}
+
+MeshStats MeshBuilder::stats(VertexFormat format) const {
+    MeshStats stats;
+    stats.format = p_impl->resolve_format(format);
+    const u64 vertex_size = renderer::vertex_size(stats.format);
+    stats.quad_count = p_impl->result.size() / impl::sizeof_quad;
+    stats.vertex_count = stats.quad_count * vertices_per_quad;
+    stats.vertex_bytes = stats.vertex_count * vertex_size;
+    const u64 unindexed_vertex_count = stats.quad_count * indices_per_quad;
+    stats.saved_vertex_count = unindexed_vertex_count - stats.vertex_count;
+    stats.saved_bytes = stats.saved_vertex_count * vertex_size;
+    return stats;
+}
+
+std::vector<float> const& MeshBuilder::vertices() const { return p_impl->result; }
+
+void MeshBuilder::append(MeshBuilder const& other) {
+    auto& result = p_impl->result;
+    result.insert(result.end(), other.p_impl->result.begin(), other.p_impl->result.end());
+    p_impl->fits_compact = p_impl->fits_compact && other.p_impl->fits_compact;
+    extend(p_impl->bounds, other.p_impl->bounds);
+}
+
+std::vector<QuadRange> MeshBuilder::add_chunks_parallel(
+    std::size_t chunk_count,
+    std::function<void(MeshBuilder&, std::size_t)> const& build_chunk,
+    u32 thread_count) {
+    std::vector<MeshBuilder> chunks(chunk_count);
+    util::parallel_for(chunk_count, thread_count,
+                       [&](std::size_t chunk) { build_chunk(chunks[chunk], chunk); });
+
+    // Merge the segments in chunk order, so that the output doesn't depend on scheduling.
+    auto& result = p_impl->result;
+    std::vector<std::size_t> chunk_offsets(chunk_count);
+    std::vector<QuadRange> chunk_ranges(chunk_count);
+    std::size_t total_size = result.size();
+    for (std::size_t chunk = 0; chunk < chunk_count; ++chunk) {
+        const std::size_t chunk_size = chunks[chunk].p_impl->result.size();
+        chunk_offsets[chunk] = total_size;
+        chunk_ranges[chunk] = {static_cast<u32>(total_size / impl::sizeof_quad),
+                               static_cast<u32>(chunk_size / impl::sizeof_quad)};
+        total_size += chunk_size;
+        p_impl->fits_compact = p_impl->fits_compact && chunks[chunk].p_impl->fits_compact;
+        extend(p_impl->bounds, chunks[chunk].p_impl->bounds);
+    }
+    result.resize(total_size);
+    util::parallel_for(chunk_count, thread_count, [&](std::size_t chunk) {
+        auto const& chunk_result = chunks[chunk].p_impl->result;
+        std::memcpy(result.data() + chunk_offsets[chunk], chunk_result.data(),
+                    chunk_result.size() * sizeof(float));
+    });
+    return chunk_ranges;
+}
+
+std::vector<CompactVertex> to_compact_vertices(std::vector<float> const& vertices) {
+    const std::size_t vertex_count = vertices.size() / floats_per_vertex;
+    std::vector<CompactVertex> compact(vertex_count);
+    for (std::size_t i = 0; i < vertex_count; ++i) {
+        const float* v = vertices.data() + i * floats_per_vertex;
+        compact[i] = {{float_to_half(v[0]), float_to_half(v[1]), float_to_half(v[2])},
+                      0,
+                      {float_to_unorm16(v[3]), float_to_unorm16(v[4])}};
+    }
+    return compact;
+}
+
+void MeshBuilder::impl::reset() {
+    result.clear();
+    fits_compact = true;
+    bounds = {};
+}
+
+void extend(AABB& box, AABB const& other) {
+    box.min = {aml::min(box.min.x, other.min.x), aml::min(box.min.y, other.min.y),
+               aml::min(box.min.z, other.min.z)};
+    box.max = {aml::max(box.max.x, other.max.x), aml::max(box.max.y, other.max.y),
+               aml::max(box.max.z, other.max.z)};
+}
+
+} // namespace aryibi::renderer
@@ -0,0 +1,65 @@
+#ifndef ARYIBI_MESH_BUILDER_HPP
+#define ARYIBI_MESH_BUILDER_HPP
+
+#include "aryibi/renderer.hpp"
+
+#include <cstddef>
+#include <vector>
+
+// Backend-agnostic part of MeshBuilder. Everything here works without a rendering context, only
+// MeshBuilder::finish() is implemented by the backend.
+
+namespace aryibi::renderer {
+
+/// Meshes are made out of quads with 4 unique vertices each, drawn as two indexed triangles.
+constexpr u32 vertices_per_quad = 4;
+constexpr u32 indices_per_quad = 6;
+/// Vertices are built as 3 position floats followed by 2 UV floats.
+constexpr u32 floats_per_vertex = 5;
+
+/// The vertex layout used by VertexFormat::compact.
+struct CompactVertex {
+    /// Half floats.
+    u16 position[3];
+    u16 padding;
+    /// Normalized unsigned shorts.
+    u16 uv[2];
+};
+static_assert(sizeof(CompactVertex) == 12);
+
+/// @returns The size of a single vertex in the given format, in bytes.
+constexpr std::size_t vertex_size(VertexFormat format) {
+    return format == VertexFormat::compact ? sizeof(CompactVertex) :
+                                             floats_per_vertex * sizeof(float);
+}
+
+/// Converts a float to a half float, rounding to the nearest even value.
+u16 float_to_half(float value);
+float half_to_float(u16 half);
+/// Grows an AABB so that it contains another one.
+void extend(AABB& box, AABB const& other);
+/// Converts vertices built by MeshBuilder to VertexFormat::compact. Only valid if they fit in it.
+std::vector<CompactVertex> to_compact_vertices(std::vector<float> const& vertices);
+
+struct MeshBuilder::impl {
+    std::vector<float> result;
+    /// True if all the vertices in result can be stored in VertexFormat::compact without losing
+    /// precision.
+    bool fits_compact = true;
+    /// The bounds of all the vertices in result.
+    AABB bounds;
+
+    /// Returns the format that would be used if the given one was requested.
+    [[nodiscard]] VertexFormat resolve_format(VertexFormat requested) const {
+        return requested == VertexFormat::compact && !fits_compact ? VertexFormat::full : requested;
+    }
+    /// Clears all the data, leaving the builder as if it was just created.
+    void reset();
+
+    static constexpr auto sizeof_vertex = floats_per_vertex;
+    static constexpr auto sizeof_quad = vertices_per_quad * sizeof_vertex;
+};
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_MESH_BUILDER_HPP
@@ -0,0 +1,13 @@
+#ifndef ARYIBI_EMBEDDED_SHADERS_HPP
+#define ARYIBI_EMBEDDED_SHADERS_HPP
+
+namespace aryibi::renderer {
+
+/// @returns The source of one of the shaders in assets/, embedded in the library when it's built.
+/// Throws std::runtime_error if there's no shader with that file name.
+/// @param name The file name of the shader, e.g. "shaded_tile.frag".
+const char* embedded_shader(const char* name);
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_EMBEDDED_SHADERS_HPP
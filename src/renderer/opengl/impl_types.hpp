@@ -1,57 +1,382 @@
 #ifndef ARYIBI_OPENGL_IMPL_TYPES_HPP
 #define ARYIBI_OPENGL_IMPL_TYPES_HPP
 
+#include <glad/glad.h>
+
 #include "aryibi/renderer.hpp"
+#include "renderer/mesh_builder.hpp"
+#include "renderer/shadow_atlas.hpp"
+#include "renderer/spatial_grid.hpp"
+#include "util/hash.hpp"
+#include "util/radix_sort.hpp"
+#include "util/thread_pool.hpp"
 
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
+#ifdef ARYIBI_DETECT_RENDERER_LEAKS
+#    include <unordered_set>
+#endif
 
 namespace aryibi::renderer {
 
-struct TextureHandle::impl {
-    u32 width;
-    u32 height;
-    ColorType color_type;
-    FilteringMethod filter;
-    u32 handle = 0;
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    static inline std::unordered_map<u32, u32> handle_ref_count;
-#endif
+/// The texture units each sampler is bound to. Samplers are assigned to these when the shader is
+/// created, so the renderer doesn't need to set them on every draw.
+namespace texture_units {
+constexpr u32 tile = 0;
+constexpr u32 shadow = 1;
+constexpr u32 palette = 2;
+} // namespace texture_units
+
+/// Vertex attribute locations used by every shader. Attributes from mesh vertices always come
+/// first, followed by the per-instance ones.
+namespace vertex_attributes {
+constexpr u32 position = 0;
+constexpr u32 uv = 1;
+constexpr u32 instance_offset = 2;
+constexpr u32 instance_tint = 3;
+/// The vertex buffer binding points the mesh and per-instance attributes read from.
+constexpr u32 vertex_binding = 0;
+constexpr u32 instance_binding = 1;
+} // namespace vertex_attributes
+
+/// Per-instance data, as read by the instance attributes. Every draw is instanced: Regular
+/// commands are a single instance offset by the command transform.
+struct InstanceVertex {
+    float offset[3];
+    /// RGBA8, in the same layout as Color.
+    u32 tint;
 };
+static_assert(sizeof(InstanceVertex) == 16);
 
-struct MeshHandle::impl {
-    u32 vbo = 0;
-    u32 vao = 0;
-    u32 vertex_count;
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    static inline std::unordered_map<u32, u32> handle_ref_count;
+/// Handles are plain values, so instead of reference counting their copies we keep track of the
+/// objects that have been created and not unloaded yet, and report them when the renderer is
+/// destroyed.
+struct LiveObjects {
+    /// Textures can be created from the loader thread, so they're protected by this.
+    static inline std::mutex textures_mutex;
+    static inline std::unordered_set<u32> textures;
+    static inline std::unordered_set<u32> meshes;
+    static inline std::unordered_set<u32> framebuffers;
+};
 #endif
+
+/// Shader storage buffer binding points used by the lit shaders.
+namespace storage_bindings {
+constexpr u32 lights = 5;
+constexpr u32 point_lights = 6;
+constexpr u32 light_grid = 7;
+} // namespace storage_bindings
+
+/// CPU-side mirror of the light storage blocks of the lit shaders, following the std430 layout.
+/// The offsets must match the ones written next to the blocks in assets/shaded_tile.frag.
+namespace std430 {
+
+/// The start of the Lights block, which is followed by every directional light.
+struct LightsHeader {
+    float ambient_light_color[3];
+    u32 directional_light_count;
+    /// How many light tiles the screen is split in, horizontally and vertically.
+    u32 tile_count[2];
+    /// The side of each light tile, in pixels.
+    u32 tile_size;
+    u32 point_light_count;
+};
+static_assert(offsetof(LightsHeader, directional_light_count) == 12);
+static_assert(offsetof(LightsHeader, tile_count) == 16);
+static_assert(offsetof(LightsHeader, point_light_count) == 28);
+static_assert(sizeof(LightsHeader) == 32);
+
+struct DirectionalLight {
+    /// RGB is the color, A is the intensity.
+    float color[4];
+    float light_space_matrix[16];
+    float light_atlas_pos[2];
+    float light_atlas_size;
+    float padding;
+};
+static_assert(offsetof(DirectionalLight, light_space_matrix) == 16);
+static_assert(offsetof(DirectionalLight, light_atlas_pos) == 80);
+static_assert(offsetof(DirectionalLight, light_atlas_size) == 88);
+static_assert(sizeof(DirectionalLight) == 96);
+
+struct PointLight {
+    /// RGB is the color, A is the intensity.
+    float color[4];
+    float radius;
+    float padding0[3];
+    float light_space_matrix[16];
+    float position[3];
+    float padding1;
+    float light_atlas_pos[2];
+    float light_atlas_size;
+    float padding2;
+};
+static_assert(offsetof(PointLight, radius) == 16);
+static_assert(offsetof(PointLight, light_space_matrix) == 32);
+static_assert(offsetof(PointLight, position) == 96);
+static_assert(offsetof(PointLight, light_atlas_pos) == 112);
+static_assert(offsetof(PointLight, light_atlas_size) == 120);
+static_assert(sizeof(PointLight) == 128);
+
+} // namespace std430
+
+/// A persistently mapped buffer split in regions that are written in turns, one per frame. Each
+/// region is fenced once the commands reading it have been submitted, and it's only written again
+/// after the GPU is done with it, so the CPU never has to stall on a buffer that's in use (Unless
+/// it gets more than `regions` frames ahead).
+class MappedBufferRing {
+public:
+    static constexpr u32 regions = 3;
+
+    /// Creates the buffer. `alignment` is the minimum alignment of each region's offset.
+    void init(std::size_t region_size, std::size_t region_alignment);
+    void destroy();
+
+    /// Moves on to the next region, waiting for the GPU to stop using it if needed.
+    /// @returns A pointer to the region, which is valid until the next call to advance().
+    void* advance();
+    /// Makes every region at least `region_size` bytes big, recreating the buffer if needed. The
+    /// contents of every region are lost when that happens.
+    void reserve(std::size_t region_size);
+    /// Fences the current region. Call after submitting the commands that read it.
+    void fence_current();
+
+    [[nodiscard]] u32 handle() const { return buffer; }
+    [[nodiscard]] std::size_t current_offset() const { return current * region_stride; }
+
+private:
+    u32 buffer = 0;
+    std::size_t region_stride = 0;
+    std::size_t alignment = 1;
+    std::byte* mapped = nullptr;
+    GLsync fences[regions] = {};
+    u32 current = 0;
+};
+
+/// The sources of every shader loaded from files, so that variants of them can be compiled later
+/// on, along with the variants compiled so far.
+struct ShaderSources {
+    std::string vert;
+    std::string frag;
+    std::vector<ShaderDefine> defines;
+    /// Compiled variants, keyed by the extra defines they were requested with, as inserted in the
+    /// source.
+    std::map<std::string, u32> variants;
+    /// Whether the shader has a shadow sampler, which makes it lit. Only known once it's ready.
+    bool lit = false;
+
+    /// Keyed by the program of the shader loaded from the sources.
+    static inline std::unordered_map<u32, ShaderSources> of_program;
+};
+
+/// Programs that were started to be compiled and linked, but haven't been checked yet. See
+/// ShaderHandle::ready().
+struct PendingPrograms {
+    struct Build {
+        u32 program = 0;
+        /// 0 if the program was loaded from the binary cache, which means it's already linked.
+        u32 vert = 0;
+        u32 frag = 0;
+        /// Kept for error messages.
+        std::string vert_source;
+        std::string frag_source;
+        /// 0 if the binary cache is disabled.
+        u64 cache_key = 0;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /// Keyed by program.
+    static inline std::unordered_map<u32, Build> builds;
 };
 
-struct ShaderHandle::impl {
+/// @returns True if the current context supports the given OpenGL extension.
+bool has_gl_extension(const char* name);
+
+/// On-disk cache of linked program binaries. See ShaderHandle::set_binary_cache_directory().
+struct ProgramBinaryCache {
+    /// Empty if disabled.
+    static inline std::filesystem::path directory;
+    static inline ShaderCacheStats stats;
+};
+
+/// Makes sure the GPU has finished executing every command issued so far by the current context,
+/// so that the objects they created or modified can be used from other contexts. Flushes the
+/// command queue as needed.
+void wait_for_gpu();
+
+/// Textures being loaded by TextureHandle::from_file_*_async(). Files are decoded by the worker
+/// pool, and uploaded by the loader thread if there's one, or on the render thread through pixel
+/// buffer objects otherwise.
+struct TextureLoader {
+    struct Load {
+        /// Loads in the decoded state are in upload_queue, and those in the uploading state are
+        /// being uploaded by the loader thread.
+        enum class State { decoding, decoded, uploading, uploaded };
+        State state = State::decoding;
+        /// Written by the worker that decodes the file, and freed once uploaded. Empty if the file
+        /// couldn't be loaded.
+        std::vector<u8> data;
+        u32 width = 0;
+        u32 height = 0;
+        TextureHandle::ColorType type = TextureHandle::ColorType::rgba;
+        TextureHandle::FilteringMethod filter = TextureHandle::FilteringMethod::point;
+        /// Only exists once uploaded.
+        TextureHandle texture;
+        /// The staging buffer the texture was uploaded from, and a fence that is signaled once the
+        /// upload has finished. Both are deleted then.
+        u32 pixel_buffer = 0;
+        GLsync upload_fence = nullptr;
+    };
+
+    /// Protects loads, the state of every load, upload_queue and uploader.
+    static inline std::mutex mutex;
+    static inline std::condition_variable state_changed;
+    /// Keyed by TextureLoad::id.
+    static inline std::unordered_map<u32, std::shared_ptr<Load>> loads;
+    static inline u32 next_id = 1;
+    /// Decoded loads waiting to be uploaded, oldest first.
+    static inline std::deque<std::shared_ptr<Load>> upload_queue;
+    /// Uploaded loads whose staging buffer still exists. Only used by the render thread.
+    static inline std::vector<std::shared_ptr<Load>> in_flight;
+    /// The renderer's loader thread. Null if there's no renderer or it doesn't support background
+    /// loading.
+    static inline util::ThreadPool* uploader = nullptr;
+    /// Declared last so that it's destroyed first, as its threads use everything above.
+    static inline util::ThreadPool workers;
+
+    /// Uploads a decoded load. Must be called on the render thread without the mutex locked.
+    static void upload(std::shared_ptr<Load> const& load);
+    /// Uploads a decoded load directly, and waits for the GPU to finish. Must be called on the
+    /// loader thread without the mutex locked.
+    static void upload_in_background(Load& load);
+    /// @returns True if the GPU has finished reading the staging buffer of an uploaded load,
+    /// deleting the buffer if so. Must be called on the render thread.
+    static bool upload_finished(Load& load);
+    /// Uploads decoded loads, oldest first, until the budget runs out, and deletes the staging
+    /// buffers that aren't needed anymore. Always uploads at least one load if there are any.
+    static void upload_decoded(std::chrono::steady_clock::duration budget);
+    /// Deletes every staging buffer.
+    static void release_all();
+};
+
+/// Matches the layout glMultiDrawElementsIndirect expects.
+struct DrawElementsIndirectCommand {
+    u32 count;
+    u32 instance_count;
+    u32 first_index;
+    i32 base_vertex;
+    u32 base_instance;
+};
+
+/// A single draw request, taken from either a DrawCmd or an InstancedDrawCmd.
+struct DrawItem {
+    u32 shader;
+    u32 texture;
+    VertexFormat format;
+    /// ID of the mesh drawn. Never reused, unlike its storage.
+    u32 mesh;
+    u32 first_storage_quad;
+    u32 quads;
+    u32 first_instance;
+    u32 instance_count;
+    /// See MeshStates.
+    u32 mesh_revision;
+    /// Bounds of every instance, in world units.
+    AABB bounds;
+    bool cast_shadows;
+    bool translucent;
+};
+
+/// Consecutive indirect commands that share the same state, drawn with a single call.
+struct DrawBatch {
+    u32 shader;
+    u32 texture;
+    VertexFormat format;
+    u32 first_command;
+    u32 command_count;
+};
+
+/// A buffer whose contents are completely replaced every frame.
+struct StreamBuffer {
     u32 handle = 0;
-    u32 tile_tex_location = -1;
-    u32 shadow_tex_location = -1;
-    u32 palette_tex_location = -1;
+    std::size_t capacity = 0;
+
+    /// Replaces the contents of the buffer, growing it if needed. The previous contents are
+    /// orphaned so that draws still reading them don't stall the upload.
+    void upload(const void* data, std::size_t bytes);
 };
 
-struct MeshBuilder::impl {
-    std::vector<float> result;
+/// Vertex storage shared by every mesh of a vertex format. Meshes are ranges of quads suballocated
+/// from a single buffer, so all of them share one VAO and can be drawn together with a single
+/// multi-draw call. Arenas are created when first needed and destroyed along with the renderer.
+struct VertexArena {
+    VertexFormat format;
+    u32 vao = 0;
+    u32 buffer = 0;
+    u32 quad_capacity = 0;
+    /// Unused ranges of quads in the buffer, as first quad -> quad count.
+    std::map<u32, u32> free_ranges{};
+
+    /// @returns The arena used by meshes of the given format.
+    static VertexArena& get(VertexFormat format);
+    /// Destroys the storage of every arena. Meshes that still exist become invalid.
+    static void release_all();
+    /// Makes the VAO of every arena read instance attributes from the given buffer.
+    static void set_instance_buffer(u32 buffer);
 
-    static constexpr auto sizeof_vertex = 5;
-    static constexpr auto sizeof_triangle = 3 * sizeof_vertex;
-    static constexpr auto sizeof_quad = 2 * sizeof_triangle;
+    /// Reserves `quads` consecutive quads, growing the buffer if there isn't enough free space.
+    /// Growing keeps the VAO and the buffer contents, so existing meshes stay valid.
+    /// @returns The first quad of the reserved range.
+    u32 allocate(u32 quads);
+    /// Gives back a range of quads returned by allocate().
+    void free(u32 first_quad, u32 quads);
+
+private:
+    void grow(u32 min_free_quads);
 };
 
-struct Framebuffer::impl {
-    unsigned int handle = -1;
-    TextureHandle tex;
-    [[nodiscard]] bool exists() const;
-    void create_handle();
-    void bind_texture();
+/// The parts of each mesh that change when its quads are modified. Handles are plain values, so
+/// these can't be stored in them: Every copy of a handle reads them from here instead.
+struct MeshStates {
+    struct State {
+        u32 quads = 0;
+        /// See MeshHandle::bounds().
+        AABB bounds;
+        /// How many times the quads of the mesh have been modified since it was created.
+        u32 revision = 0;
+    };
 
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    static inline std::unordered_map<u32, u32> handle_ref_count;
-#endif
+    /// Keyed by mesh ID. Only meshes that exist are in the map.
+    static inline std::unordered_map<u32, State> of_mesh;
+
+    /// @returns The state of a mesh, or an empty one if it doesn't exist.
+    [[nodiscard]] static State const& of(u32 mesh_id) {
+        static const State missing;
+        const auto it = of_mesh.find(mesh_id);
+        return it == of_mesh.end() ? missing : it->second;
+    }
+};
+
+/// Index buffer shared by every mesh. The indices for quad N are always the same
+/// ({4N, 4N+1, 4N+2, 4N+1, 4N+3, 4N+2}), so a single buffer big enough for the largest mesh can be
+/// bound to every VAO.
+struct QuadIndexBuffer {
+    static inline u32 handle = 0;
+    static inline u32 quad_capacity = 0;
+
+    /// Makes sure the buffer contains indices for at least `quads` quads. The buffer name never
+    /// changes when growing, so VAOs that already reference it stay valid.
+    static void reserve(u32 quads);
 };
 
 struct Renderer::impl {
@@ -59,14 +384,76 @@ struct Renderer::impl {
     ShaderHandle lit_shader;
     ShaderHandle unlit_shader;
     ShaderHandle depth_shader;
+    /// Depth shader used to draw several shadow maps at once. Only exists if supported.
+    ShaderHandle layered_depth_shader;
+    /// Assigns the tiles of shadow_depth_fb to lights.
+    ShadowAtlas shadow_atlas;
+    /// How many shadow maps can be drawn at once. 0 if single pass shadows aren't supported.
+    u32 max_shadow_views = 0;
+    bool single_pass_shadows = true;
+    bool depth_prepass = false;
+    /// See TextureLoader::upload_decoded().
+    std::chrono::steady_clock::duration texture_upload_budget = std::chrono::milliseconds(2);
+    /// Runs jobs with the loader context of the window current. Null if the window doesn't have
+    /// one.
+    std::unique_ptr<util::ThreadPool> loader_thread;
     Framebuffer shadow_depth_fb;
+    /// Samples shadow_depth_fb with hardware depth comparisons.
+    u32 shadow_sampler = 0;
+    ShadowQuality shadow_quality = ShadowQuality::pcf5x5;
     TextureHandle palette_texture;
 
     Framebuffer window_framebuffer;
 
-    unsigned int lights_ubo;
+    /// Ring of storage buffers holding every light storage block, and the data last written to
+    /// it. The ring only advances when the data changes.
+    MappedBufferRing lights_buffer;
+    std::vector<std::byte> light_data;
+    std::vector<std::byte> last_light_data;
+    /// GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT.
+    std::size_t storage_buffer_alignment = 1;
+    /// The first index and count of each light tile's point lights, followed by the point light
+    /// indices of every tile.
+    std::vector<u32> light_grid;
+
+    RenderStats last_draw_stats;
+
+    /// Storage for sorting draw commands, kept between frames to avoid reallocating it.
+    std::vector<util::SortItem> sort_items;
+    std::vector<util::SortItem> sort_scratch;
+    /// Small indices given to each shader and texture while building sort keys, so that they fit
+    /// in 16 bits regardless of the actual object names.
+    std::unordered_map<u32, u16> shader_ranks;
+    std::unordered_map<u32, u16> texture_ranks;
+
+    /// Everything that needs to be drawn this frame, regular commands first and instanced commands
+    /// after, in the same order as in the command list.
+    std::vector<DrawItem> draw_items;
+    /// Indices of draw_items, in the order they're drawn in the main, translucent and shadow
+    /// passes.
+    std::vector<u32> main_pass_items;
+    std::vector<u32> translucent_pass_items;
+    std::vector<u32> shadow_pass_items;
+    /// Shadow casters by position, to find the ones near each light without testing all of them.
+    SpatialGrid shadow_caster_grid;
+    /// For every draw item, its position in shadow_pass_items.
+    std::vector<u32> shadow_pass_positions;
+    /// For each light, the shadow casters near it.
+    std::vector<std::vector<u32>> casters_per_light;
+    /// Indirect commands of every pass, grouped in batches.
+    std::vector<DrawElementsIndirectCommand> indirect_commands;
+    std::vector<DrawBatch> batches;
+
+    /// Stream buffers refilled every frame with instance_data and indirect_commands.
+    StreamBuffer instance_buffer;
+    std::vector<InstanceVertex> instance_data;
+    StreamBuffer indirect_buffer;
+
+    /// For each light, a hash of everything that was drawn to its shadow map tile last time.
+    /// Tiles whose hash doesn't change aren't drawn again.
+    std::vector<u64> shadow_signatures;
 };
 
-}
+} // namespace aryibi::renderer
 
 #endif // ARYIBI_OPENGL_IMPL_TYPES_HPP
@@ -12,7 +12,9 @@
 
 #include "aryibi/renderer.hpp"
 #include "aryibi/windowing.hpp"
+#include "renderer/opengl/embedded_shaders.hpp"
 #include "renderer/opengl/impl_types.hpp"
+#include "renderer/sort_key.hpp"
 
 #include <anton/math/matrix4.hpp>
 #include <anton/math/vector4.hpp>
@@ -20,8 +22,13 @@
 #include <anton/math/vector2.hpp>
 #include "util/aryibi_assert.hpp"
 
+#include <algorithm>
+#include <array>
+#include <utility>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <string>
 #include <cstring> // For memcpy
 
 namespace aml = anton::math;
@@ -83,12 +90,193 @@ static void debug_callback(GLenum const source,
     ARYIBI_ASSERT(severity != GL_DEBUG_SEVERITY_HIGH, "OpenGL Internal Fatal Error!");
 }
 
+/// @returns False if the given bounds are guaranteed to be outside of the volume seen through
+/// `view_proj`. This is conservative: Boxes that are close to
+/// a corner of the volume might return true even if they aren't visible.
+bool is_visible(aryibi::renderer::AABB const& bounds, aml::Matrix4 const& view_proj) {
+    if (bounds.empty())
+        return false;
+    const float* m = view_proj.get_raw();
+    // How many box corners are outside each clip plane, in -X, +X, -Y, +Y, -Z, +Z order.
+    int corners_outside[6] = {};
+    for (int corner = 0; corner < 8; ++corner) {
+        const float x = corner & 1 ? bounds.max.x : bounds.min.x;
+        const float y = corner & 2 ? bounds.max.y : bounds.min.y;
+        const float z = corner & 4 ? bounds.max.z : bounds.min.z;
+        // Matrices are stored column-major.
+        float clip[4];
+        for (int row = 0; row < 4; ++row)
+            clip[row] = m[row] * x + m[4 + row] * y + m[8 + row] * z + m[12 + row];
+        for (int axis = 0; axis < 3; ++axis) {
+            corners_outside[axis * 2] += clip[axis] < -clip[3];
+            corners_outside[axis * 2 + 1] += clip[axis] > clip[3];
+        }
+    }
+    for (const int count : corners_outside) {
+        if (count == 8)
+            return false;
+    }
+    return true;
+}
+
+/// Lit shader variants are specialized on the amount of directional lights up to this many.
+constexpr anton::u32 max_specialized_directional_lights = 4;
+
+/// Size of the screen tiles that get their own point light list, in pixels.
+constexpr anton::u32 light_tile_size = 32;
+
+/// Finds the light tiles of the screen a box covers.
+/// @param result Set to the minimum X, minimum Y, maximum X and maximum Y tile, all inclusive.
+/// @returns False if the box is completely off-screen, in which case result isn't set.
+bool screen_tiles(aryibi::renderer::AABB const& bounds,
+                  aml::Matrix4 const& view_proj,
+                  anton::u32 screen_width,
+                  anton::u32 screen_height,
+                  std::array<anton::u32, 4>& result) {
+    const float* m = view_proj.get_raw();
+    float min_x = std::numeric_limits<float>::infinity(), min_y = min_x;
+    float max_x = -min_x, max_y = -min_x;
+    for (int corner = 0; corner < 8; ++corner) {
+        const float x = corner & 1 ? bounds.max.x : bounds.min.x;
+        const float y = corner & 2 ? bounds.max.y : bounds.min.y;
+        const float z = corner & 4 ? bounds.max.z : bounds.min.z;
+        // Matrices are stored column-major.
+        float clip[4];
+        for (int row = 0; row < 4; ++row)
+            clip[row] = m[row] * x + m[4 + row] * y + m[8 + row] * z + m[12 + row];
+        min_x = std::min(min_x, clip[0] / clip[3]);
+        max_x = std::max(max_x, clip[0] / clip[3]);
+        min_y = std::min(min_y, clip[1] / clip[3]);
+        max_y = std::max(max_y, clip[1] / clip[3]);
+    }
+    if (max_x < -1 || min_x > 1 || max_y < -1 || min_y > 1)
+        return false;
+    // From NDC to pixels to tiles.
+    const auto to_tile = [](float ndc, anton::u32 screen_size) {
+        const float pixel = (std::clamp(ndc, -1.f, 1.f) * 0.5f + 0.5f) * screen_size;
+        const anton::u32 last_tile = (screen_size + light_tile_size - 1) / light_tile_size - 1;
+        return std::min(static_cast<anton::u32>(pixel) / light_tile_size, last_tile);
+    };
+    result = {to_tile(min_x, screen_width), to_tile(min_y, screen_height),
+              to_tile(max_x, screen_width), to_tile(max_y, screen_height)};
+    return true;
+}
+
+/// Smallest shadow map tile size, in texels.
+constexpr anton::u32 min_shadow_tile_size = 32;
+
+/// @returns The deepest level of the shadow atlas allowed for a shadow map of the given size.
+anton::u32 shadow_atlas_levels(anton::u32 width, anton::u32 height) {
+    anton::u32 levels = 0;
+    while ((std::min(width, height) >> (levels + 1)) >= min_shadow_tile_size) ++levels;
+    return levels;
+}
+
+/// @returns The ID of a light in the shadow atlas, which is kept across frames as long as the light
+/// stays at the same index of its list.
+anton::u32 shadow_atlas_id(bool point_light, anton::u32 index) {
+    return index * 2 + (point_light ? 1 : 0);
+}
+
+/// Size of the light matrix array in assets/depth_layered.vert.
+constexpr anton::u32 max_layered_shadow_views = 16;
+
+/// @returns True if a box intersects a sphere.
+bool intersects_sphere(aryibi::renderer::AABB const& box,
+                       aml::Vector3 const& center,
+                       float radius) {
+    const float dx = aml::max(aml::max(box.min.x - center.x, center.x - box.max.x), 0.f);
+    const float dy = aml::max(aml::max(box.min.y - center.y, center.y - box.max.y), 0.f);
+    const float dz = aml::max(aml::max(box.min.z - center.z, center.z - box.max.z), 0.f);
+    return dx * dx + dy * dy + dz * dz <= radius * radius;
+}
+
+/// @returns The bounds of the volume seen through a view-projection matrix.
+aryibi::renderer::AABB view_volume_bounds(aml::Matrix4 const& view_proj) {
+    const aml::Matrix4 inverse = aml::inverse(view_proj);
+    const float* m = inverse.get_raw();
+    aryibi::renderer::AABB bounds;
+    for (int corner = 0; corner < 8; ++corner) {
+        const float ndc[3] = {corner & 1 ? 1.f : -1.f, corner & 2 ? 1.f : -1.f,
+                              corner & 4 ? 1.f : -1.f};
+        // Matrices are stored column-major.
+        float world[4];
+        for (int row = 0; row < 4; ++row)
+            world[row] = m[row] * ndc[0] + m[4 + row] * ndc[1] + m[8 + row] * ndc[2] + m[12 + row];
+        const aml::Vector3 point{world[0] / world[3], world[1] / world[3], world[2] / world[3]};
+        aryibi::renderer::extend(bounds, {point, point});
+    }
+    return bounds;
+}
+
+/// The objects last bound while drawing, used to skip redundant state changes.
+struct BoundState {
+    static constexpr anton::u32 unknown = static_cast<anton::u32>(-1);
+    anton::u32 shader = unknown;
+    anton::u32 texture = unknown;
+    anton::u32 vertex_array = unknown;
+};
+
+/// @returns The rank given to `id` in `ranks`, adding it if it doesn't have one yet. Ranks saturate
+/// at 0xFFFF; Objects that share a rank are still drawn correctly, they just might not be grouped
+/// together.
+anton::u16 rank_of(std::unordered_map<anton::u32, anton::u16>& ranks, anton::u32 id) {
+    const auto [it, inserted] = ranks.try_emplace(id, 0);
+    if (inserted)
+        it->second = static_cast<anton::u16>(std::min<std::size_t>(ranks.size() - 1, 0xFFFF));
+    return it->second;
+}
+
 } // namespace
 
 namespace aryibi::renderer {
 
 Renderer::~Renderer() {
     ARYIBI_LOG("Deleting renderer");
+    if (p_impl->loader_thread) {
+        {
+            std::lock_guard lock(TextureLoader::mutex);
+            TextureLoader::uploader = nullptr;
+        }
+        // Wait for pending jobs, and release the context so that its window can be destroyed.
+        std::promise<void> released;
+        p_impl->loader_thread->submit([&released]() {
+            glfwMakeContextCurrent(nullptr);
+            released.set_value();
+        });
+        released.get_future().wait();
+        p_impl->loader_thread.reset();
+    }
+    p_impl->lit_pal_shader.unload();
+    p_impl->lit_shader.unload();
+    p_impl->unlit_shader.unload();
+    p_impl->depth_shader.unload();
+    p_impl->layered_depth_shader.unload();
+    p_impl->shadow_depth_fb.unload();
+    p_impl->palette_texture.unload();
+    p_impl->lights_buffer.destroy();
+    TextureLoader::release_all();
+    glDeleteSamplers(1, &p_impl->shadow_sampler);
+    glDeleteBuffers(1, &p_impl->instance_buffer.handle);
+    glDeleteBuffers(1, &p_impl->indirect_buffer.handle);
+    VertexArena::release_all();
+    glDeleteBuffers(1, &QuadIndexBuffer::handle);
+    QuadIndexBuffer::handle = 0;
+    QuadIndexBuffer::quad_capacity = 0;
+
+#ifdef ARYIBI_DETECT_RENDERER_LEAKS
+    if (!LiveObjects::textures.empty())
+        ARYIBI_LOG((std::to_string(LiveObjects::textures.size()) +
+                    " textures were never unloaded!")
+                       .c_str());
+    if (!LiveObjects::meshes.empty())
+        ARYIBI_LOG(
+            (std::to_string(LiveObjects::meshes.size()) + " meshes were never unloaded!").c_str());
+    if (!LiveObjects::framebuffers.empty())
+        ARYIBI_LOG((std::to_string(LiveObjects::framebuffers.size()) +
+                    " framebuffers were never unloaded!")
+                       .c_str());
+#endif
     glfwTerminate();
 }
 
@@ -102,6 +290,15 @@ Renderer::Renderer(windowing::WindowHandle _w) : window(_w), p_impl(std::make_un
     ARYIBI_ASSERT(gladLoadGLLoader((GLADloadproc)&glfwGetProcAddress),
                   "OpenGL didn't initialize correctly!");
 
+    if (GLFWwindow* const loader_context = window.p_impl->loader_context) {
+        // Jobs run in order on a single thread, so the context stays current for the next ones.
+        p_impl->loader_thread = std::make_unique<util::ThreadPool>(1);
+        p_impl->loader_thread->submit(
+            [loader_context]() { glfwMakeContextCurrent(loader_context); });
+        std::lock_guard lock(TextureLoader::mutex);
+        TextureLoader::uploader = p_impl->loader_thread.get();
+    }
+
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glEnable(GL_DEPTH_TEST);
@@ -119,14 +316,43 @@ Renderer::Renderer(windowing::WindowHandle _w) : window(_w), p_impl(std::make_un
     ImGui_ImplGlfw_InitForOpenGL(window.p_impl->handle, true);
     ImGui_ImplOpenGL3_Init(glsl_version);
 
-    p_impl->lit_shader =
-        ShaderHandle::from_file("assets/shaded_tile.vert", "assets/shaded_tile.frag");
-    p_impl->unlit_shader =
-        ShaderHandle::from_file("assets/basic_tile.vert", "assets/basic_tile.frag");
-    p_impl->lit_pal_shader =
-        ShaderHandle::from_file("assets/shaded_pal_tile.vert", "assets/shaded_pal_tile.frag");
+    // Built-in shaders are embedded in the library. Start compiling all of them before checking
+    // any, so that the driver can work on them at the same time.
+    const auto load_builtin = [](const char* vert_name, const char* frag_name) {
+        return ShaderHandle::from_source_async(embedded_shader(vert_name),
+                                               embedded_shader(frag_name));
+    };
+    p_impl->lit_shader = load_builtin("shaded_tile.vert", "shaded_tile.frag");
+    p_impl->unlit_shader = load_builtin("basic_tile.vert", "basic_tile.frag");
+    p_impl->lit_pal_shader = load_builtin("shaded_pal_tile.vert", "shaded_pal_tile.frag");
+    p_impl->depth_shader = load_builtin("depth.vert", "depth.frag");
+    // Drawing every shadow map in a single pass requires choosing the viewport in the vertex shader.
+    const bool layered_shadows_supported =
+        has_gl_extension("GL_ARB_shader_viewport_layer_array");
+    if (layered_shadows_supported)
+        p_impl->layered_depth_shader = load_builtin("depth_layered.vert", "depth.frag");
 
-    p_impl->depth_shader = ShaderHandle::from_file("assets/depth.vert", "assets/depth.frag");
+    for (auto* shader : {&p_impl->lit_shader, &p_impl->unlit_shader, &p_impl->lit_pal_shader,
+                         &p_impl->depth_shader})
+        shader->wait();
+    if (layered_shadows_supported) {
+        try {
+            p_impl->layered_depth_shader.wait();
+            int max_viewports;
+            glGetIntegerv(GL_MAX_VIEWPORTS, &max_viewports);
+            p_impl->max_shadow_views = std::min<u32>(max_viewports, max_layered_shadow_views);
+        } catch (std::runtime_error const& error) {
+            p_impl->layered_depth_shader = ShaderHandle();
+            ARYIBI_LOG((std::string("Single pass shadows disabled: ") + error.what()).c_str());
+        }
+    }
+    // Every draw is instanced with its offset already applied, so the model matrix of the depth
+    // shaders never changes.
+    glProgramUniformMatrix4fv(p_impl->depth_shader.id, 0, 1, GL_FALSE,
+                              aml::Matrix4::identity.get_raw());
+    if (p_impl->layered_depth_shader.exists())
+        glProgramUniformMatrix4fv(p_impl->layered_depth_shader.id, 0, 1, GL_FALSE,
+                                  aml::Matrix4::identity.get_raw());
 
     TextureHandle tex;
     constexpr u32 default_shadow_res_width = 1024;
@@ -134,13 +360,25 @@ Renderer::Renderer(windowing::WindowHandle _w) : window(_w), p_impl(std::make_un
     tex.init(default_shadow_res_width, default_shadow_res_height, TextureHandle::ColorType::depth,
              TextureHandle::FilteringMethod::point);
     p_impl->shadow_depth_fb = Framebuffer(tex);
+    p_impl->shadow_atlas.reset(
+        shadow_atlas_levels(default_shadow_res_width, default_shadow_res_height));
+    // Lit shaders compare depths in hardware instead of reading them, so they can fetch several
+    // comparisons at once.
+    glCreateSamplers(1, &p_impl->shadow_sampler);
+    glSamplerParameteri(p_impl->shadow_sampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glSamplerParameteri(p_impl->shadow_sampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glSamplerParameteri(p_impl->shadow_sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(p_impl->shadow_sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(p_impl->shadow_sampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glSamplerParameteri(p_impl->shadow_sampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    int storage_buffer_alignment;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_buffer_alignment);
+    p_impl->storage_buffer_alignment = storage_buffer_alignment;
+    // Grows when needed. This is enough for a few lights on a 1080p screen.
+    constexpr std::size_t initial_lights_buffer_size = 64 * 1024;
+    p_impl->lights_buffer.init(initial_lights_buffer_size, storage_buffer_alignment);
 
-    constexpr u64 lights_ubo_aligned_size = 3088;
-    glGenBuffers(1, &p_impl->lights_ubo);
-    glBindBuffer(GL_UNIFORM_BUFFER, p_impl->lights_ubo);
-    glBufferData(GL_UNIFORM_BUFFER, lights_ubo_aligned_size, nullptr, GL_DYNAMIC_DRAW);
-
-    p_impl->window_framebuffer.p_impl->handle = 0;
+    p_impl->window_framebuffer.id = 0;
 }
 
 ShaderHandle Renderer::lit_shader() const { return p_impl->lit_shader; }
@@ -148,6 +386,8 @@ ShaderHandle Renderer::unlit_shader() const { return p_impl->unlit_shader; }
 ShaderHandle Renderer::lit_paletted_shader() const { return p_impl->lit_pal_shader; }
 
 void Renderer::start_frame(Color clear_color) {
+    TextureLoader::upload_decoded(p_impl->texture_upload_budget);
+
     // Start the ImGui frame
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
@@ -173,16 +413,18 @@ Framebuffer Renderer::get_window_framebuffer() {
     int display_w, display_h;
     glfwGetFramebufferSize(window.p_impl->handle, &display_w, &display_h);
     TextureHandle virtual_window_tex;
-    virtual_window_tex.p_impl->width = display_w;
-    virtual_window_tex.p_impl->height = display_h;
-    virtual_window_tex.p_impl->filter = TextureHandle::FilteringMethod::point;
-    virtual_window_tex.p_impl->color_type = TextureHandle::ColorType::rgba;
-    p_impl->window_framebuffer.p_impl->tex = virtual_window_tex;
-    p_impl->window_framebuffer.p_impl->handle = 0;
+    virtual_window_tex.w = display_w;
+    virtual_window_tex.h = display_h;
+    virtual_window_tex.filtering = TextureHandle::FilteringMethod::point;
+    virtual_window_tex.type = TextureHandle::ColorType::rgba;
+    p_impl->window_framebuffer.tex = virtual_window_tex;
+    p_impl->window_framebuffer.id = 0;
     return p_impl->window_framebuffer;
 }
 
 void Renderer::draw(DrawCmdList const& draw_commands, Framebuffer const& output_fb) {
+    RenderStats& stats = p_impl->last_draw_stats;
+    stats = {};
     aml::Vector2 camera_view_size_in_tiles{
         (float)output_fb.texture().width() / draw_commands.camera.unit_size,
         (float)output_fb.texture().height() / draw_commands.camera.unit_size};
@@ -206,28 +448,55 @@ void Renderer::draw(DrawCmdList const& draw_commands, Framebuffer const& output_
         aml::perspective_rh(point_light_fov, 1, point_light_near, point_light_far);
     const float point_light_far_plane_size = aml::abs(2 * aml::tan(point_light_fov) * point_light_far);
 
-    /// The light depth texture is divided into NxN tiles, each one representing a light.
-    /// This constant represents N.
-    const int light_atlas_tiles = aml::ceil(
-        aml::sqrt(draw_commands.directional_lights.size() + draw_commands.point_lights.size()));
-
-    /// Update light UBO data
-    glBindBuffer(GL_UNIFORM_BUFFER, p_impl->lights_ubo);
-    const u32 directional_lights_count = draw_commands.directional_lights.size();
-    glBufferSubData(GL_UNIFORM_BUFFER, 480, 4, &directional_lights_count);
-
-    const u32 point_lights_count = draw_commands.point_lights.size();
-    glBufferSubData(GL_UNIFORM_BUFFER, 3056, 4, &point_lights_count);
-    constexpr u64 directional_light_size_aligned = 96;
-    u64 directional_light_i = 0;
-    ARYIBI_ASSERT(draw_commands.directional_lights.size() <= 5,
-                  "Maximum directional light count (5) surpassed!");
+    // Give each light a tile of the shadow atlas depending on how much of the screen it lights.
+    // Directional lights light all of it.
+    const AABB camera_bounds = view_volume_bounds(proj * view);
+    const float camera_area = (camera_bounds.max.x - camera_bounds.min.x) *
+                              (camera_bounds.max.y - camera_bounds.min.y);
+    std::vector<ShadowAtlas::Request> atlas_requests;
+    for (u32 i = 0; i < draw_commands.directional_lights.size(); ++i)
+        atlas_requests.push_back(
+            {shadow_atlas_id(false, i), draw_commands.directional_lights[i].shadow_priority});
+    for (u32 i = 0; i < draw_commands.point_lights.size(); ++i) {
+        const auto& point_light = draw_commands.point_lights[i];
+        const float lit_width =
+            aml::min(point_light.position.x + point_light.radius, camera_bounds.max.x) -
+            aml::max(point_light.position.x - point_light.radius, camera_bounds.min.x);
+        const float lit_height =
+            aml::min(point_light.position.y + point_light.radius, camera_bounds.max.y) -
+            aml::max(point_light.position.y - point_light.radius, camera_bounds.min.y);
+        const float coverage =
+            aml::max(lit_width, 0.f) * aml::max(lit_height, 0.f) / camera_area;
+        atlas_requests.push_back(
+            {shadow_atlas_id(true, i), point_light.shadow_priority * coverage});
+    }
+    std::vector<ShadowAtlas::Tile> atlas_tiles;
+    p_impl->shadow_atlas.allocate(atlas_requests, atlas_tiles);
+
+    /// Fill the light buffer data
+    const u32 screen_width = output_fb.texture().width();
+    const u32 screen_height = output_fb.texture().height();
+    const u32 tiles_x = (screen_width + light_tile_size - 1) / light_tile_size;
+    const u32 tiles_y = (screen_height + light_tile_size - 1) / light_tile_size;
+    std430::LightsHeader header{};
+    header.directional_light_count = draw_commands.directional_lights.size();
+    header.point_light_count = draw_commands.point_lights.size();
+    header.tile_count[0] = tiles_x;
+    header.tile_count[1] = tiles_y;
+    header.tile_size = light_tile_size;
+    std::vector<std430::DirectionalLight> directional_lights(
+        draw_commands.directional_lights.size());
+    std::vector<std430::PointLight> point_lights(draw_commands.point_lights.size());
+    const auto copy_matrix = [](aml::Matrix4 const& matrix, float (&result)[16]) {
+        std::memcpy(result, matrix.get_raw(), sizeof(result));
+    };
+    u32 directional_light_i = 0;
     for (const auto& directional_light : draw_commands.directional_lights) {
-        aml::Vector4 color{directional_light.color.fred(), directional_light.color.fgreen(),
-                           directional_light.color.fblue(), directional_light.intensity};
-        static_assert(sizeof(aml::Vector4) == 16);
-        glBufferSubData(GL_UNIFORM_BUFFER, directional_light_i * directional_light_size_aligned + 0,
-                        16, &color.r);
+        auto& gpu_light = directional_lights[directional_light_i];
+        gpu_light.color[0] = directional_light.color.fred();
+        gpu_light.color[1] = directional_light.color.fgreen();
+        gpu_light.color[2] = directional_light.color.fblue();
+        gpu_light.color[3] = directional_light.intensity;
 
         // To create the light view, we position the light as if it were a camera and
         // then invert the matrix.
@@ -241,39 +510,23 @@ void Renderer::draw(DrawCmdList const& draw_commands, Framebuffer const& output_
                      aml::rotate_x(directional_light.rotation.x);
         lightView = aml::inverse(lightView);
         directional_light.matrix = proj * lightView;
-        static_assert(sizeof(aml::Matrix4) == 64);
-        static_assert(sizeof(aml::Vector2) == 8);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        directional_light_i * directional_light_size_aligned + 16, 64,
-                        directional_light.matrix.get_raw());
-        directional_light.light_atlas_pos = {
-            (float)(directional_light_i % light_atlas_tiles) / (float)light_atlas_tiles,
-            (float)(directional_light_i / light_atlas_tiles) / (float)light_atlas_tiles};
-        directional_light.light_atlas_size = 1.f / (float)light_atlas_tiles;
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        directional_light_i * directional_light_size_aligned + 80, 8,
-                        &directional_light.light_atlas_pos.x);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        directional_light_i * directional_light_size_aligned + 88, 4,
-                        &directional_light.light_atlas_size);
+        copy_matrix(directional_light.matrix, gpu_light.light_space_matrix);
+        directional_light.light_atlas_pos = atlas_tiles[directional_light_i].position;
+        directional_light.light_atlas_size = atlas_tiles[directional_light_i].size;
+        gpu_light.light_atlas_pos[0] = directional_light.light_atlas_pos.x;
+        gpu_light.light_atlas_pos[1] = directional_light.light_atlas_pos.y;
+        gpu_light.light_atlas_size = directional_light.light_atlas_size;
         ++directional_light_i;
     }
 
-    ARYIBI_ASSERT(draw_commands.directional_lights.size() <= 20,
-                  "Maximum point light count (20) surpassed!");
-    constexpr u64 point_light_size_aligned = 128;
-    constexpr u64 point_lights_offset = 496;
-    u64 point_light_i = 0;
+    u32 point_light_i = 0;
     for (const auto& point_light : draw_commands.point_lights) {
-        aml::Vector4 color{point_light.color.fred(), point_light.color.fgreen(),
-                           point_light.color.fblue(), point_light.intensity};
-        static_assert(sizeof(aml::Vector4) == 16);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        point_lights_offset + point_light_i * point_light_size_aligned + 0, 16,
-                        &color.r);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        point_lights_offset + point_light_i * point_light_size_aligned + 16, 4,
-                        &point_light.radius);
+        auto& gpu_light = point_lights[point_light_i];
+        gpu_light.color[0] = point_light.color.fred();
+        gpu_light.color[1] = point_light.color.fgreen();
+        gpu_light.color[2] = point_light.color.fblue();
+        gpu_light.color[3] = point_light.intensity;
+        gpu_light.radius = point_light.radius;
 
         // To create the light view, we position the light as if it were a camera and
         // then invert the matrix.
@@ -284,125 +537,722 @@ void Renderer::draw(DrawCmdList const& draw_commands, Framebuffer const& output_
                                 aml::scale({light_view_scale, light_view_scale, 1});
         lightView = aml::inverse(lightView);
         point_light.matrix = point_light_proj * lightView;
-        static_assert(sizeof(aml::Matrix4) == 64);
-        static_assert(sizeof(aml::Vector2) == 8);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        point_lights_offset + point_light_i * point_light_size_aligned + 32, 64,
-                        point_light.matrix.get_raw());
-        point_light.light_atlas_pos = {
-            (float)((directional_lights_count + point_light_i) % light_atlas_tiles) /
-                (float)light_atlas_tiles,
-            (float)((directional_lights_count + point_light_i) / light_atlas_tiles) /
-                (float)light_atlas_tiles};
-        point_light.light_atlas_size = 1.f / (float)light_atlas_tiles;
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        point_lights_offset + point_light_i * point_light_size_aligned + 96, 12,
-                        &point_light.position.x);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        point_lights_offset + point_light_i * point_light_size_aligned + 112, 8,
-                        &point_light.light_atlas_pos.x);
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        point_lights_offset + point_light_i * point_light_size_aligned + 120, 4,
-                        &point_light.light_atlas_size);
+        copy_matrix(point_light.matrix, gpu_light.light_space_matrix);
+        point_light.light_atlas_pos = atlas_tiles[directional_light_i + point_light_i].position;
+        point_light.light_atlas_size = atlas_tiles[directional_light_i + point_light_i].size;
+        gpu_light.position[0] = point_light.position.x;
+        gpu_light.position[1] = point_light.position.y;
+        gpu_light.position[2] = point_light.position.z;
+        gpu_light.light_atlas_pos[0] = point_light.light_atlas_pos.x;
+        gpu_light.light_atlas_pos[1] = point_light.light_atlas_pos.y;
+        gpu_light.light_atlas_size = point_light.light_atlas_size;
         ++point_light_i;
     }
-    aml::Vector3 ambient_light_color{draw_commands.ambient_light_color.fred(),
-                                     draw_commands.ambient_light_color.fgreen(),
-                                     draw_commands.ambient_light_color.fblue()};
-    glBufferSubData(GL_UNIFORM_BUFFER, 3072, 12, &ambient_light_color.x);
+    header.ambient_light_color[0] = draw_commands.ambient_light_color.fred();
+    header.ambient_light_color[1] = draw_commands.ambient_light_color.fgreen();
+    header.ambient_light_color[2] = draw_commands.ambient_light_color.fblue();
 
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    // Build the list of point lights that reach each screen tile, so that fragments only evaluate
+    // those. The grid starts with the first index and count of each tile, followed by the lists.
+    auto& light_grid = p_impl->light_grid;
+    const u32 tile_count = tiles_x * tiles_y;
+    light_grid.assign(tile_count * 2, 0);
+    std::vector<std::array<u32, 4>> light_tile_ranges(draw_commands.point_lights.size());
+    std::vector<bool> light_on_screen(draw_commands.point_lights.size());
+    for (u32 i = 0; i < draw_commands.point_lights.size(); ++i) {
+        const auto& point_light = draw_commands.point_lights[i];
+        const aml::Vector3 extent{point_light.radius, point_light.radius, point_light.radius};
+        light_on_screen[i] = screen_tiles({point_light.position - extent,
+                                           point_light.position + extent},
+                                          proj * view, screen_width, screen_height,
+                                          light_tile_ranges[i]);
+        if (!light_on_screen[i])
+            continue;
+        const auto& range = light_tile_ranges[i];
+        for (u32 y = range[1]; y <= range[3]; ++y)
+            for (u32 x = range[0]; x <= range[2]; ++x) ++light_grid[(y * tiles_x + x) * 2 + 1];
+    }
+    u32 light_list_end = tile_count * 2;
+    for (u32 tile = 0; tile < tile_count; ++tile) {
+        light_grid[tile * 2] = light_list_end;
+        light_list_end += light_grid[tile * 2 + 1];
+        // Reset the count, it's used as the insertion point below.
+        light_grid[tile * 2 + 1] = 0;
+    }
+    light_grid.resize(light_list_end);
+    for (u32 i = 0; i < draw_commands.point_lights.size(); ++i) {
+        if (!light_on_screen[i])
+            continue;
+        const auto& range = light_tile_ranges[i];
+        for (u32 y = range[1]; y <= range[3]; ++y) {
+            for (u32 x = range[0]; x <= range[2]; ++x) {
+                const u32 tile = y * tiles_x + x;
+                light_grid[light_grid[tile * 2] + light_grid[tile * 2 + 1]++] = i;
+            }
+        }
+    }
 
-    glUseProgram(p_impl->depth_shader.p_impl->handle);
-    glBindFramebuffer(GL_FRAMEBUFFER, p_impl->shadow_depth_fb.p_impl->handle);
-    glClear(GL_DEPTH_BUFFER_BIT);
-    glDepthFunc(GL_LEQUAL);
-    glActiveTexture(GL_TEXTURE0);
-    int light_index = 0;
-    for (const auto& directional_light : draw_commands.directional_lights) {
-        static const auto light_atlas_pos_location =
-            glGetUniformLocation(p_impl->depth_shader.p_impl->handle, "light_atlas_pos");
-        static const auto light_atlas_size_location =
-            glGetUniformLocation(p_impl->depth_shader.p_impl->handle, "light_atlas_size");
-        glViewport(directional_light.light_atlas_pos.x * p_impl->shadow_depth_fb.texture().width(),
-                   directional_light.light_atlas_pos.y * p_impl->shadow_depth_fb.texture().height(),
-                   directional_light.light_atlas_size * p_impl->shadow_depth_fb.texture().width(),
-                   directional_light.light_atlas_size * p_impl->shadow_depth_fb.texture().height());
-        glUniformMatrix4fv(3, 1, GL_FALSE, directional_light.matrix.get_raw()); // Light view matrix
-        for (const auto& cmd : draw_commands.commands) {
-            if (!cmd.cast_shadows)
-                continue;
-            aml::Matrix4 model = aml::translate(cmd.transform.position);
+    // Every block lives in the same buffer. Runtime sized arrays can't be empty, so each block
+    // gets at least one element.
+    const auto& alignment = p_impl->storage_buffer_alignment;
+    const auto align = [&](std::size_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    };
+    const std::size_t header_size =
+        sizeof(std430::LightsHeader) +
+        std::max<std::size_t>(directional_lights.size(), 1) * sizeof(std430::DirectionalLight);
+    const std::size_t point_lights_offset = align(header_size);
+    const std::size_t point_lights_size =
+        std::max<std::size_t>(point_lights.size(), 1) * sizeof(std430::PointLight);
+    const std::size_t light_grid_offset = align(point_lights_offset + point_lights_size);
+    const std::size_t light_grid_size = std::max<std::size_t>(light_grid.size(), 1) * sizeof(u32);
+    auto& light_data = p_impl->light_data;
+    light_data.assign(light_grid_offset + light_grid_size, std::byte{0});
+    std::memcpy(light_data.data(), &header, sizeof(header));
+    std::memcpy(light_data.data() + sizeof(header), directional_lights.data(),
+                directional_lights.size() * sizeof(std430::DirectionalLight));
+    std::memcpy(light_data.data() + point_lights_offset, point_lights.data(),
+                point_lights.size() * sizeof(std430::PointLight));
+    std::memcpy(light_data.data() + light_grid_offset, light_grid.data(),
+                light_grid.size() * sizeof(u32));
 
-            glBindVertexArray(cmd.mesh.p_impl->vao);
-            glBindTexture(GL_TEXTURE_2D, cmd.texture.p_impl->handle);
-            glUniformMatrix4fv(0, 1, GL_FALSE, model.get_raw()); // Model matrix
-            glDrawArrays(GL_TRIANGLES, 0, cmd.mesh.p_impl->vertex_count);
+    // Lights rarely change between frames. When they don't, keep using the region that already
+    // has them instead of writing another one.
+    if (light_data != p_impl->last_light_data) {
+        p_impl->lights_buffer.reserve(light_data.size());
+        std::memcpy(p_impl->lights_buffer.advance(), light_data.data(), light_data.size());
+        p_impl->last_light_data = light_data;
+    }
 
-            ++light_index;
+    // Lit shaders are drawn with a variant that skips whatever the lights of this frame don't need.
+    // Shaders that don't use some of these defines simply ignore them.
+    const bool any_shadows =
+        p_impl->shadow_quality != ShadowQuality::off &&
+        std::any_of(atlas_tiles.begin(), atlas_tiles.end(),
+                    [](ShadowAtlas::Tile const& tile) { return tile.size != 0; });
+    std::vector<ShaderDefine> light_defines{
+        {"SHADOW_QUALITY",
+         std::to_string(static_cast<u32>(any_shadows ? p_impl->shadow_quality : ShadowQuality::off))},
+        {"POINT_LIGHTS", light_list_end > tile_count * 2 ? "1" : "0"}};
+    if (draw_commands.directional_lights.size() <= max_specialized_directional_lights)
+        light_defines.push_back(
+            {"DIRECTIONAL_LIGHT_COUNT", std::to_string(draw_commands.directional_lights.size())});
+    // Variants are compiled in the background. Until they're ready, or if they fail to compile,
+    // the shader itself is drawn instead, since it handles every light configuration.
+    std::unordered_map<u32, u32> lit_variants;
+    const auto variant_for_lights = [&](ShaderHandle const& shader) {
+        const auto sources = ShaderSources::of_program.find(shader.id);
+        if (sources == ShaderSources::of_program.end() || !sources->second.lit)
+            return shader.id;
+        const auto [variant, inserted] = lit_variants.try_emplace(shader.id, shader.id);
+        if (inserted) {
+            const ShaderHandle specialized = shader.variant(light_defines);
+            try {
+                if (specialized.exists() && specialized.ready())
+                    variant->second = specialized.id;
+            } catch (std::runtime_error const& error) {
+                ARYIBI_LOG((std::string("Using an unspecialized lit shader: ") + error.what())
+                               .c_str());
+            }
         }
+        return variant->second;
+    };
+
+    // Every command is drawn as instances read from instance_buffer, with an identity model
+    // matrix. Regular commands are a single instance offset by their transform, so commands that
+    // share state can be drawn together regardless of where they are.
+    auto& items = p_impl->draw_items;
+    auto& instance_data = p_impl->instance_data;
+    items.clear();
+    instance_data.clear();
+    for (const auto& cmd : draw_commands.commands) {
+        const auto& position = cmd.transform.position;
+        const auto& mesh_state = MeshStates::of(cmd.mesh.id);
+        const auto& bounds = mesh_state.bounds;
+        const AABB world_bounds =
+            bounds.empty() ? AABB{} :
+                             AABB{{bounds.min.x + position.x, bounds.min.y + position.y,
+                                   bounds.min.z + position.z},
+                                  {bounds.max.x + position.x, bounds.max.y + position.y,
+                                   bounds.max.z + position.z}};
+        items.push_back({variant_for_lights(cmd.shader), cmd.texture.id, cmd.mesh.format,
+                         cmd.mesh.id, cmd.mesh.first_storage_quad, mesh_state.quads,
+                         static_cast<u32>(instance_data.size()), 1, mesh_state.revision,
+                         world_bounds, cmd.cast_shadows, cmd.translucent});
+        instance_data.push_back({{position.x, position.y, position.z}, colors::white.hex_val});
     }
-    for (const auto& point_light : draw_commands.point_lights) {
-        static const auto light_atlas_pos_location =
-            glGetUniformLocation(p_impl->depth_shader.p_impl->handle, "light_atlas_pos");
-        static const auto light_atlas_size_location =
-            glGetUniformLocation(p_impl->depth_shader.p_impl->handle, "light_atlas_size");
-        glViewport(point_light.light_atlas_pos.x * p_impl->shadow_depth_fb.texture().width(),
-                   point_light.light_atlas_pos.y * p_impl->shadow_depth_fb.texture().height(),
-                   point_light.light_atlas_size * p_impl->shadow_depth_fb.texture().width(),
-                   point_light.light_atlas_size * p_impl->shadow_depth_fb.texture().height());
-        glUniformMatrix4fv(3, 1, GL_FALSE, point_light.matrix.get_raw()); // Light view matrix
-        for (const auto& cmd : draw_commands.commands) {
-            if (!cmd.cast_shadows)
+    for (const auto& cmd : draw_commands.instanced_commands) {
+        const auto& mesh_state = MeshStates::of(cmd.mesh.id);
+        DrawItem item{variant_for_lights(cmd.shader),
+                      cmd.texture.id,
+                      cmd.mesh.format,
+                      cmd.mesh.id,
+                      cmd.mesh.first_storage_quad,
+                      mesh_state.quads,
+                      static_cast<u32>(instance_data.size()),
+                      static_cast<u32>(cmd.instances.size()),
+                      mesh_state.revision,
+                      {},
+                      cmd.cast_shadows,
+                      cmd.translucent};
+        const auto& bounds = mesh_state.bounds;
+        for (const auto& instance : cmd.instances) {
+            const aml::Vector3 offset{cmd.transform.position.x + instance.offset.x,
+                                      cmd.transform.position.y + instance.offset.y,
+                                      cmd.transform.position.z + instance.offset.z};
+            instance_data.push_back({{offset.x, offset.y, offset.z}, instance.tint.hex_val});
+            if (!bounds.empty())
+                extend(item.bounds, {{bounds.min.x + offset.x, bounds.min.y + offset.y,
+                                      bounds.min.z + offset.z},
+                                     {bounds.max.x + offset.x, bounds.max.y + offset.y,
+                                      bounds.max.z + offset.z}});
+        }
+        items.push_back(item);
+    }
+
+    // See sort_key.hpp for how keys are laid out. Instanced commands aren't sorted and always go
+    // after the regular ones.
+    p_impl->shader_ranks.clear();
+    p_impl->texture_ranks.clear();
+    const auto build_draw_order = [&](DrawOrder order, auto const& filter,
+                                      std::vector<u32>& result) {
+        auto& sort_items = p_impl->sort_items;
+        sort_items.clear();
+        for (u32 i = 0; i < draw_commands.commands.size(); ++i) {
+            const auto& item = items[i];
+            if (!filter(item))
+                continue;
+            if (order == DrawOrder::submission) {
+                sort_items.push_back({i, i});
                 continue;
-            aml::Matrix4 model = aml::translate(cmd.transform.position);
+            }
 
-            glBindVertexArray(cmd.mesh.p_impl->vao);
-            glBindTexture(GL_TEXTURE_2D, cmd.texture.p_impl->handle);
-            glUniformMatrix4fv(0, 1, GL_FALSE, model.get_raw()); // Model matrix
-            glDrawArrays(GL_TRIANGLES, 0, cmd.mesh.p_impl->vertex_count);
+            const u64 state_key = sort_key::state(rank_of(p_impl->shader_ranks, item.shader),
+                                                  rank_of(p_impl->texture_ranks, item.texture),
+                                                  item.format);
+            const float z =
+                item.bounds.empty() ? 0.f : (item.bounds.min.z + item.bounds.max.z) / 2.f;
+            const u64 depth = sort_key::depth(draw_commands.camera.position.z, z);
+            sort_items.push_back({sort_key::make(order, state_key, depth), i});
+        }
+        if (order != DrawOrder::submission)
+            util::radix_sort(sort_items, p_impl->sort_scratch);
 
-            ++light_index;
+        result.clear();
+        for (const auto& sort_item : sort_items) result.push_back(sort_item.index);
+        for (u32 i = draw_commands.commands.size(); i < items.size(); ++i) {
+            if (filter(items[i]))
+                result.push_back(i);
         }
+    };
+    build_draw_order(draw_commands.order, [](DrawItem const& item) { return !item.translucent; },
+                     p_impl->main_pass_items);
+    // Translucent commands blend with whatever is behind them, so that must be drawn first.
+    build_draw_order(draw_commands.order == DrawOrder::submission ? DrawOrder::submission :
+                                                                    DrawOrder::back_to_front,
+                     [](DrawItem const& item) { return item.translucent; },
+                     p_impl->translucent_pass_items);
+    // The depth shader writes depth, not color, so shadow casters can always be grouped by state.
+    build_draw_order(draw_commands.order == DrawOrder::submission ? DrawOrder::submission :
+                                                                    DrawOrder::state,
+                     [](DrawItem const& item) { return item.cast_shadows; },
+                     p_impl->shadow_pass_items);
+
+    // Cull and batch every pass before drawing anything, so that all the indirect commands can be
+    // uploaded at once.
+    auto& indirect_commands = p_impl->indirect_commands;
+    auto& batches = p_impl->batches;
+    indirect_commands.clear();
+    batches.clear();
+    struct PassBatches {
+        std::size_t first_batch;
+        std::size_t batch_count;
+    };
+    enum class PassKind {
+        /// Draws commands with their own shader.
+        color,
+        /// Draws the depth of the commands that will be drawn later on in a color pass.
+        depth_prepass,
+        /// Draws the depth of shadow casters, which have already been culled for the light.
+        shadow
+    };
+    const auto build_pass = [&](std::vector<u32> const& pass_items, aml::Matrix4 const& view_proj,
+                                PassKind kind) {
+        // Commands in the depth prepass were already counted by the color pass that draws them,
+        // and shadow casters were counted when culled.
+        const bool cull = kind != PassKind::shadow;
+        const bool count_stats = kind == PassKind::color;
+        PassBatches pass{batches.size(), 0};
+        for (const u32 item_index : pass_items) {
+            const auto& item = items[item_index];
+            if (cull && !is_visible(item.bounds, view_proj)) {
+                if (count_stats)
+                    ++stats.commands_culled;
+                continue;
+            }
+            if (count_stats) {
+                ++stats.commands_submitted;
+                if (item_index >= draw_commands.commands.size())
+                    stats.instances_submitted += item.instance_count;
+            }
+
+            // Passes that only draw depth always use the depth shader.
+            const u32 shader = kind == PassKind::color ? item.shader : p_impl->depth_shader.id;
+            if (batches.size() == pass.first_batch || batches.back().shader != shader ||
+                batches.back().texture != item.texture || batches.back().format != item.format)
+                batches.push_back({shader, item.texture, item.format,
+                                   static_cast<u32>(indirect_commands.size()), 0});
+            indirect_commands.push_back({item.quads * indices_per_quad, item.instance_count, 0,
+                                         static_cast<i32>(item.first_storage_quad *
+                                                          vertices_per_quad),
+                                         item.first_instance});
+            ++batches.back().command_count;
+        }
+        pass.batch_count = batches.size() - pass.first_batch;
+        return pass;
+    };
+    /// @returns A hash of everything drawn in a shadow pass, used to know whether its tile of the
+    /// shadow atlas has to be redrawn.
+    const auto shadow_signature = [&](std::vector<u32> const& light_casters, Light const& light) {
+        u64 hash = util::fnv1a_offset_basis;
+        for (const u32 item_index : light_casters) {
+            const auto& item = items[item_index];
+            // Where the mesh and instances are stored doesn't change what is drawn, so only their
+            // contents are hashed: The mesh by its ID, which is never reused, and its revision.
+            hash = util::fnv1a(&item.texture, sizeof(item.texture), hash);
+            hash = util::fnv1a(&item.format, sizeof(item.format), hash);
+            hash = util::fnv1a(&item.mesh, sizeof(item.mesh), hash);
+            hash = util::fnv1a(&item.mesh_revision, sizeof(item.mesh_revision), hash);
+            hash = util::fnv1a(&item.quads, sizeof(item.quads), hash);
+            hash = util::fnv1a(&item.instance_count, sizeof(item.instance_count), hash);
+            hash = util::fnv1a(instance_data.data() + item.first_instance,
+                               item.instance_count * sizeof(InstanceVertex), hash);
+        }
+        hash = util::fnv1a(light.matrix.get_raw(), 16 * sizeof(float), hash);
+        hash = util::fnv1a(&light.light_atlas_pos, sizeof(light.light_atlas_pos), hash);
+        return util::fnv1a(&light.light_atlas_size, sizeof(light.light_atlas_size), hash);
+    };
+    // Each light only looks at the casters near it, found through a grid, instead of at all of
+    // them. The casters found are drawn in the same order as in shadow_pass_items.
+    auto& grid = p_impl->shadow_caster_grid;
+    auto& casters_per_light = p_impl->casters_per_light;
+    auto& shadow_pass_positions = p_impl->shadow_pass_positions;
+    grid.clear();
+    shadow_pass_positions.resize(items.size());
+    for (u32 i = 0; i < p_impl->shadow_pass_items.size(); ++i) {
+        const u32 item_index = p_impl->shadow_pass_items[i];
+        shadow_pass_positions[item_index] = i;
+        grid.insert(item_index, items[item_index].bounds);
     }
+    const auto gather_casters = [&](AABB const& area, auto const& filter,
+                                    std::vector<u32>& light_casters) {
+        grid.query(area, light_casters);
+        const std::size_t found = light_casters.size();
+        light_casters.erase(std::remove_if(light_casters.begin(), light_casters.end(),
+                                           [&](u32 item) { return !filter(items[item]); }),
+                            light_casters.end());
+        std::sort(light_casters.begin(), light_casters.end(), [&](u32 a, u32 b) {
+            return shadow_pass_positions[a] < shadow_pass_positions[b];
+        });
+        // Casters never looked at are culled too.
+        stats.shadow_casters_culled += p_impl->shadow_pass_items.size() - found;
+        stats.shadow_casters_culled += found - light_casters.size();
+    };
 
-    glViewport(0, 0, output_fb.texture().width(), output_fb.texture().height());
-    glBindFramebuffer(GL_FRAMEBUFFER, output_fb.p_impl->handle);
-    for (const auto& cmd : draw_commands.commands) {
-        bool is_lit = cmd.shader.p_impl->shadow_tex_location != static_cast<u32>(-1);
-        bool is_paletted = cmd.shader.p_impl->palette_tex_location != static_cast<u32>(-1);
-        aml::Matrix4 model = aml::translate(cmd.transform.position);
-
-        glUseProgram(cmd.shader.p_impl->handle);
-        glUniformMatrix4fv(0, 1, GL_FALSE, model.get_raw()); // Model matrix
-        glUniformMatrix4fv(1, 1, GL_FALSE, proj.get_raw());  // Projection matrix
-        glUniformMatrix4fv(2, 1, GL_FALSE, view.get_raw());  // View matrix
-        glBindVertexArray(cmd.mesh.p_impl->vao);
-
-        glUniform1i(cmd.shader.p_impl->tile_tex_location,
-                    0); // Set tile sampler2D to GL_TEXTURE0
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, cmd.texture.p_impl->handle);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 5, p_impl->lights_ubo);
-        if (is_lit) {
-            glUniform1i(cmd.shader.p_impl->shadow_tex_location,
-                        1); // Set shadow sampler2D to GL_TEXTURE1
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, p_impl->shadow_depth_fb.texture().p_impl->handle);
+    // Lights are drawn in the same order as in the light UBO: Directional lights first.
+    std::vector<Light const*> shadow_lights;
+    for (const auto& directional_light : draw_commands.directional_lights)
+        shadow_lights.push_back(&directional_light);
+    for (const auto& point_light : draw_commands.point_lights)
+        shadow_lights.push_back(&point_light);
+    std::vector<u64> light_signatures(shadow_lights.size(), 0);
+    const bool shadows_enabled = p_impl->shadow_quality != ShadowQuality::off;
+    casters_per_light.resize(shadow_lights.size());
+    for (std::size_t i = 0; i < shadow_lights.size(); ++i) {
+        const Light* light = shadow_lights[i];
+        auto& light_casters = casters_per_light[i];
+        light_casters.clear();
+        // Lights that didn't get a tile in the atlas don't cast shadows.
+        if (!shadows_enabled || light->light_atlas_size == 0) {
+            stats.shadow_casters_per_light.push_back(0);
+            continue;
+        }
+        if (i < draw_commands.directional_lights.size()) {
+            gather_casters(view_volume_bounds(light->matrix),
+                           [](DrawItem const&) { return true; }, light_casters);
+        } else {
+            const auto& point_light = static_cast<PointLight const&>(*light);
+            // Point lights don't light anything outside their radius, so casters outside of it
+            // can't cast any visible shadow.
+            const float radius = point_light.radius;
+            gather_casters({{point_light.position.x - radius, point_light.position.y - radius,
+                             point_light.position.z - radius},
+                            {point_light.position.x + radius, point_light.position.y + radius,
+                             point_light.position.z + radius}},
+                           [&](DrawItem const& item) {
+                               return intersects_sphere(item.bounds, point_light.position, radius);
+                           },
+                           light_casters);
         }
-        if (is_paletted) {
-            glUniform1i(cmd.shader.p_impl->palette_tex_location,
-                        2); // Set palette sampler2D to GL_TEXTURE2
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, p_impl->palette_texture.p_impl->handle);
+        // Cull the casters before grouping lights, so that groups only draw what each of their
+        // lights can see.
+        const std::size_t found = light_casters.size();
+        light_casters.erase(std::remove_if(light_casters.begin(), light_casters.end(),
+                                           [&](u32 item) {
+                                               return !is_visible(items[item].bounds,
+                                                                  light->matrix);
+                                           }),
+                            light_casters.end());
+        stats.shadow_casters_culled += found - light_casters.size();
+        stats.shadow_casters_submitted += light_casters.size();
+        for (const u32 item_index : light_casters)
+            if (item_index >= draw_commands.commands.size())
+                stats.instances_submitted += items[item_index].instance_count;
+        stats.shadow_casters_per_light.push_back(light_casters.size());
+        light_signatures[i] = shadow_signature(light_casters, *light);
+    }
+
+    // Each light only redraws its tile of the shadow atlas if something drawn in it changed.
+    auto& shadow_signatures = p_impl->shadow_signatures;
+    shadow_signatures.resize(shadow_lights.size(), 0);
+    std::vector<std::size_t> dirty_lights;
+    for (std::size_t i = 0; i < shadow_lights.size(); ++i) {
+        if (!shadows_enabled || shadow_lights[i]->light_atlas_size == 0) {
+            shadow_signatures[i] = 0;
+            continue;
+        }
+        if (shadow_signatures[i] == light_signatures[i]) {
+            ++stats.shadow_maps_reused;
+            continue;
+        }
+        shadow_signatures[i] = light_signatures[i];
+        dirty_lights.push_back(i);
+        ++stats.shadow_maps_rendered;
+    }
+
+    // If possible, draw groups of lights at once: Every caster of the group is drawn once, with
+    // each of its instances repeated for every light of the group that sees it. The copies are
+    // sent to their light's viewport by the shader, which reads the index of the light (In the
+    // group) from the red channel of their tint.
+    struct ShadowGroup {
+        std::size_t first_dirty_light;
+        std::size_t light_count;
+        PassBatches pass;
+    };
+    std::vector<ShadowGroup> shadow_groups;
+    if (p_impl->single_pass_shadows && p_impl->max_shadow_views > 1 && dirty_lights.size() > 1) {
+        std::vector<u32> group_casters;
+        // Bit N is set if the Nth light of the group sees the caster.
+        std::vector<u32> caster_views(items.size(), 0);
+        static_assert(sizeof(u32) * 8 >= max_layered_shadow_views);
+        for (std::size_t first = 0; first < dirty_lights.size(); first += p_impl->max_shadow_views) {
+            const std::size_t light_count =
+                std::min<std::size_t>(p_impl->max_shadow_views, dirty_lights.size() - first);
+            group_casters.clear();
+            for (std::size_t i = first; i < first + light_count; ++i) {
+                const auto& light_casters = casters_per_light[dirty_lights[i]];
+                group_casters.insert(group_casters.end(), light_casters.begin(),
+                                     light_casters.end());
+                for (const u32 item_index : light_casters)
+                    caster_views[item_index] |= 1u << (i - first);
+            }
+            std::sort(group_casters.begin(), group_casters.end(), [&](u32 a, u32 b) {
+                return shadow_pass_positions[a] < shadow_pass_positions[b];
+            });
+            group_casters.erase(std::unique(group_casters.begin(), group_casters.end()),
+                                group_casters.end());
+
+            PassBatches pass{batches.size(), 0};
+            for (const u32 item_index : group_casters) {
+                const auto& item = items[item_index];
+                const u32 views = std::exchange(caster_views[item_index], 0);
+                const u32 first_instance = instance_data.size();
+                for (u32 instance = 0; instance < item.instance_count; ++instance) {
+                    for (u32 view = 0; view < light_count; ++view) {
+                        if (!(views & (1u << view)))
+                            continue;
+                        InstanceVertex copy = instance_data[item.first_instance + instance];
+                        copy.tint = view;
+                        instance_data.push_back(copy);
+                    }
+                }
+
+                if (batches.size() == pass.first_batch || batches.back().texture != item.texture ||
+                    batches.back().format != item.format)
+                    batches.push_back({p_impl->layered_depth_shader.id, item.texture, item.format,
+                                       static_cast<u32>(indirect_commands.size()), 0});
+                indirect_commands.push_back(
+                    {item.quads * indices_per_quad,
+                     static_cast<u32>(instance_data.size()) - first_instance, 0,
+                     static_cast<i32>(item.first_storage_quad * vertices_per_quad),
+                     first_instance});
+                ++batches.back().command_count;
+            }
+            pass.batch_count = batches.size() - pass.first_batch;
+            shadow_groups.push_back({first, light_count, pass});
+        }
+    }
+    // Otherwise, each dirty light is drawn on its own.
+    std::vector<PassBatches> shadow_passes(shadow_lights.size(), PassBatches{batches.size(), 0});
+    if (shadow_groups.empty())
+        for (const std::size_t light_index : dirty_lights)
+            shadow_passes[light_index] =
+                build_pass(casters_per_light[light_index], shadow_lights[light_index]->matrix,
+                           PassKind::shadow);
+
+    const PassBatches depth_prepass =
+        p_impl->depth_prepass ?
+            build_pass(p_impl->main_pass_items, proj * view, PassKind::depth_prepass) :
+            PassBatches{batches.size(), 0};
+    const PassBatches main_pass = build_pass(p_impl->main_pass_items, proj * view, PassKind::color);
+    const PassBatches translucent_pass =
+        build_pass(p_impl->translucent_pass_items, proj * view, PassKind::color);
+
+    p_impl->instance_buffer.upload(instance_data.data(),
+                                   instance_data.size() * sizeof(InstanceVertex));
+    p_impl->indirect_buffer.upload(indirect_commands.data(),
+                                   indirect_commands.size() * sizeof(DrawElementsIndirectCommand));
+    VertexArena::set_instance_buffer(p_impl->instance_buffer.handle);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, p_impl->indirect_buffer.handle);
+
+    BoundState bound;
+    // Uniforms are stored per program, so the model and camera matrices only need to be set the
+    // first time each program is used.
+    std::vector<u32> programs_with_camera;
+    const auto use_shader = [&](u32 shader) {
+        if (bound.shader == shader)
+            return;
+        glUseProgram(shader);
+        bound.shader = shader;
+        ++stats.shader_changes;
+        // Depth shaders don't use the camera, and their model matrix is set when they're created.
+        if (shader == p_impl->depth_shader.id || shader == p_impl->layered_depth_shader.id ||
+            std::find(programs_with_camera.begin(), programs_with_camera.end(), shader) !=
+                programs_with_camera.end())
+            return;
+        glUniformMatrix4fv(0, 1, GL_FALSE, aml::Matrix4::identity.get_raw()); // Model matrix
+        glUniformMatrix4fv(1, 1, GL_FALSE, proj.get_raw());                   // Projection matrix
+        glUniformMatrix4fv(2, 1, GL_FALSE, view.get_raw());                   // View matrix
+        programs_with_camera.push_back(shader);
+    };
+    const auto draw_batches = [&](PassBatches pass) {
+        for (std::size_t i = pass.first_batch; i < pass.first_batch + pass.batch_count; ++i) {
+            const auto& batch = batches[i];
+            use_shader(batch.shader);
+            const u32 vao = VertexArena::get(batch.format).vao;
+            if (bound.vertex_array != vao) {
+                glBindVertexArray(vao);
+                bound.vertex_array = vao;
+                ++stats.vertex_array_changes;
+            }
+            if (bound.texture != batch.texture) {
+                glBindTexture(GL_TEXTURE_2D, batch.texture);
+                bound.texture = batch.texture;
+                ++stats.texture_changes;
+            }
+            glMultiDrawElementsIndirect(
+                GL_TRIANGLES, GL_UNSIGNED_INT,
+                reinterpret_cast<const void*>(batch.first_command *
+                                              sizeof(DrawElementsIndirectCommand)),
+                batch.command_count, 0);
+            ++stats.draw_calls;
+        }
+    };
+
+    glBindFramebuffer(GL_FRAMEBUFFER, p_impl->shadow_depth_fb.id);
+    glDepthFunc(GL_LEQUAL);
+    glActiveTexture(GL_TEXTURE0 + texture_units::tile);
+    const auto tile_rect = [&](Light const& light) {
+        const auto& atlas = p_impl->shadow_depth_fb.texture();
+        return std::array<int, 4>{static_cast<int>(light.light_atlas_pos.x * atlas.width()),
+                                  static_cast<int>(light.light_atlas_pos.y * atlas.height()),
+                                  static_cast<int>(light.light_atlas_size * atlas.width()),
+                                  static_cast<int>(light.light_atlas_size * atlas.height())};
+    };
+    // Tiles are cleared individually so that the other ones are kept.
+    const auto clear_tile = [&](std::array<int, 4> const& rect) {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(rect[0], rect[1], rect[2], rect[3]);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_SCISSOR_TEST);
+    };
+    if (!shadow_groups.empty()) {
+        use_shader(p_impl->layered_depth_shader.id);
+        std::vector<float> viewports;
+        std::vector<float> matrices;
+        for (const auto& group : shadow_groups) {
+            viewports.clear();
+            matrices.clear();
+            for (std::size_t i = group.first_dirty_light;
+                 i < group.first_dirty_light + group.light_count; ++i) {
+                const auto& light = *shadow_lights[dirty_lights[i]];
+                const auto rect = tile_rect(light);
+                clear_tile(rect);
+                viewports.insert(viewports.end(), rect.begin(), rect.end());
+                matrices.insert(matrices.end(), light.matrix.get_raw(),
+                                light.matrix.get_raw() + 16);
+            }
+            glViewportArrayv(0, group.light_count, viewports.data());
+            glUniformMatrix4fv(2, group.light_count, GL_FALSE, matrices.data()); // Light matrices
+            draw_batches(group.pass);
+        }
+    } else {
+        use_shader(p_impl->depth_shader.id);
+        glUniformMatrix4fv(2, 1, GL_FALSE, aml::Matrix4::identity.get_raw()); // View matrix
+        for (const std::size_t light_index : dirty_lights) {
+            const auto& light = *shadow_lights[light_index];
+            const auto rect = tile_rect(light);
+            clear_tile(rect);
+            glViewport(rect[0], rect[1], rect[2], rect[3]);
+            glUniformMatrix4fv(1, 1, GL_FALSE, light.matrix.get_raw()); // Light matrix
+            draw_batches(shadow_passes[light_index]);
         }
+    }
+
+    glViewport(0, 0, output_fb.texture().width(), output_fb.texture().height());
+    glBindFramebuffer(GL_FRAMEBUFFER, output_fb.id);
+    // State that is the same for every command only needs to be set once.
+    const u32 lights_buffer = p_impl->lights_buffer.handle();
+    const std::size_t lights_offset = p_impl->lights_buffer.current_offset();
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, storage_bindings::lights, lights_buffer,
+                      lights_offset, header_size);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, storage_bindings::point_lights, lights_buffer,
+                      lights_offset + point_lights_offset, point_lights_size);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, storage_bindings::light_grid, lights_buffer,
+                      lights_offset + light_grid_offset, light_grid_size);
+    glActiveTexture(GL_TEXTURE0 + texture_units::shadow);
+    glBindTexture(GL_TEXTURE_2D, p_impl->shadow_depth_fb.texture().id);
+    glBindSampler(texture_units::shadow, p_impl->shadow_sampler);
+    glActiveTexture(GL_TEXTURE0 + texture_units::palette);
+    glBindTexture(GL_TEXTURE_2D, p_impl->palette_texture.id);
+    glActiveTexture(GL_TEXTURE0 + texture_units::tile);
+    if (depth_prepass.batch_count > 0) {
+        use_shader(p_impl->depth_shader.id);
+        // Same matrices as the tile shaders, so that depth matches theirs exactly.
+        glUniformMatrix4fv(1, 1, GL_FALSE, proj.get_raw()); // Projection matrix
+        glUniformMatrix4fv(2, 1, GL_FALSE, view.get_raw()); // View matrix
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        draw_batches(depth_prepass);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        // Depth is already final, so only the closest fragment of each pixel passes the test.
+        glDepthMask(GL_FALSE);
+    }
+    draw_batches(main_pass);
+    // Translucent commands are tested against what's been drawn, but don't hide each other.
+    glDepthMask(GL_FALSE);
+    draw_batches(translucent_pass);
+    glDepthMask(GL_TRUE);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindSampler(texture_units::shadow, 0);
+    // Fence the lights region even if it was written in a previous frame, since this one reads it
+    // too.
+    p_impl->lights_buffer.fence_current();
+}
+
+void MappedBufferRing::init(std::size_t region_size, std::size_t region_alignment) {
+    alignment = region_alignment;
+    region_stride = (region_size + alignment - 1) / alignment * alignment;
+    constexpr GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, region_stride * regions, nullptr, flags);
+    mapped = static_cast<std::byte*>(
+        glMapNamedBufferRange(buffer, 0, region_stride * regions, flags));
+    ARYIBI_ASSERT(mapped, "Couldn't map buffer!");
+    // So that the first call to advance() uses the first region.
+    current = regions - 1;
+}
+
+void MappedBufferRing::destroy() {
+    for (auto& fence : fences) {
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if (buffer != 0)
+        glUnmapNamedBuffer(buffer);
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+    mapped = nullptr;
+}
+
+void MappedBufferRing::reserve(std::size_t region_size) {
+    if (region_size <= region_stride)
+        return;
+    // The GPU might still be reading the old buffer, but deleting it is safe: The driver keeps it
+    // alive until it's done.
+    destroy();
+    init(std::max(region_size, region_stride * 2), alignment);
+}
 
-        glDrawArrays(GL_TRIANGLES, 0, cmd.mesh.p_impl->vertex_count);
+void* MappedBufferRing::advance() {
+    current = (current + 1) % regions;
+    if (GLsync& fence = fences[current]) {
+        constexpr GLuint64 timeout_ns = 1'000'000;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns) ==
+               GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fence);
+        fence = nullptr;
     }
+    return mapped + current * region_stride;
+}
+
+void MappedBufferRing::fence_current() {
+    glDeleteSync(fences[current]);
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
+void StreamBuffer::upload(const void* data, std::size_t bytes) {
+    if (handle == 0)
+        glCreateBuffers(1, &handle);
+    if (bytes > capacity) {
+        constexpr std::size_t min_stream_buffer_size = 64 * 1024;
+        capacity = std::max(capacity, min_stream_buffer_size);
+        while (capacity < bytes) capacity *= 2;
+    }
+    if (bytes == 0)
+        return;
+    // Orphan the previous contents so that we don't have to wait for the draws still using them.
+    glNamedBufferData(handle, capacity, nullptr, GL_STREAM_DRAW);
+    glNamedBufferSubData(handle, 0, bytes, data);
+}
+
+void Renderer::set_depth_prepass(bool enabled) { p_impl->depth_prepass = enabled; }
+
+bool Renderer::background_loading_supported() const { return p_impl->loader_thread != nullptr; }
+
+std::future<void> Renderer::load_in_background(std::function<void()> job) {
+    if (!p_impl->loader_thread) {
+        // Commands issued from the same context are executed in order, so there's nothing to
+        // wait for.
+        std::packaged_task<void()> task(std::move(job));
+        task();
+        return task.get_future();
+    }
+    auto task = std::make_shared<std::packaged_task<void()>>([job = std::move(job)]() {
+        job();
+        wait_for_gpu();
+    });
+    auto result = task->get_future();
+    p_impl->loader_thread->submit([task]() { (*task)(); });
+    return result;
+}
+
+void Renderer::set_texture_upload_budget(float milliseconds) {
+    p_impl->texture_upload_budget = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<float, std::milli>(milliseconds));
+}
+
+void Renderer::set_shadow_quality(ShadowQuality quality) { p_impl->shadow_quality = quality; }
+
+ShadowQuality Renderer::get_shadow_quality() const { return p_impl->shadow_quality; }
+
+void Renderer::set_single_pass_shadows(bool enabled) { p_impl->single_pass_shadows = enabled; }
+
+bool Renderer::single_pass_shadows_supported() const { return p_impl->max_shadow_views > 1; }
+
+RenderStats const& Renderer::last_draw_stats() const { return p_impl->last_draw_stats; }
+
 void Renderer::clear(Framebuffer& fb, aml::Vector4 color) {
-    glBindFramebuffer(GL_FRAMEBUFFER, fb.p_impl->handle);
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.id);
     glClearColor(color.r, color.g, color.b, color.a);
     glClear(GL_COLOR_BUFFER_BIT);
 }
@@ -446,6 +1296,9 @@ void Renderer::set_palette(ColorPalette const& palette) {
 
 void Renderer::set_shadow_resolution(u32 width, u32 height) {
     p_impl->shadow_depth_fb.resize(width, height);
+    // The contents of the atlas are lost when resizing it, and the tile sizes allowed change.
+    p_impl->shadow_signatures.clear();
+    p_impl->shadow_atlas.reset(shadow_atlas_levels(width, height));
 }
 
 aml::Vector2 Renderer::get_shadow_resolution() const {
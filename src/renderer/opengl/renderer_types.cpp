@@ -4,6 +4,7 @@
 /* clang-format on */
 
 #include "aryibi/renderer.hpp"
+#include "aryibi/palette_quantizer.hpp"
 #include "renderer/opengl/impl_types.hpp"
 #include "aryibi/sprites.hpp"
 
@@ -14,66 +15,49 @@
 #include <anton/math/vector4.hpp>
 #include "util/aryibi_assert.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <memory>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <optional>
+#include <type_traits>
 
 namespace fs = std::filesystem;
 namespace aml = anton::math;
 
 namespace aryibi::renderer {
 
-TextureHandle::TextureHandle() : p_impl(std::make_unique<impl>()) {}
-TextureHandle::~TextureHandle() {
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    if (p_impl->handle == 0 || glfwGetCurrentContext() == nullptr)
-        return;
-    ARYIBI_ASSERT(impl::handle_ref_count[p_impl->handle] != 1,
-                  "All handles to a texture were destroyed without unloading them first!!");
-    impl::handle_ref_count[p_impl->handle]--;
-#endif
-}
-TextureHandle::TextureHandle(TextureHandle const& other) : p_impl(std::make_unique<impl>()) {
-    *p_impl = *other.p_impl;
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->handle]++;
-#endif
-}
-TextureHandle& TextureHandle::operator=(TextureHandle const& other) {
-    if (this != &other) {
-        *p_impl = *other.p_impl;
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-        impl::handle_ref_count[p_impl->handle]++;
-#endif
-    }
-    return *this;
-}
+static_assert(std::is_trivially_copyable_v<TextureHandle>);
+static_assert(std::is_trivially_copyable_v<Framebuffer>);
+static_assert(std::is_trivially_copyable_v<MeshHandle>);
+static_assert(std::is_trivially_copyable_v<ShaderHandle>);
 
 ImTextureID TextureHandle::imgui_id() const {
     ARYIBI_ASSERT(exists(), "Called imgui_id() with a texture that doesn't exist!");
-    return reinterpret_cast<void*>(p_impl->handle);
+    return reinterpret_cast<void*>(static_cast<std::uintptr_t>(id));
 }
-bool TextureHandle::exists() const { return p_impl->handle != 0; }
-u32 TextureHandle::width() const { return p_impl->width; }
-u32 TextureHandle::height() const { return p_impl->height; }
-TextureHandle::ColorType TextureHandle::color_type() const { return p_impl->color_type; }
-TextureHandle::FilteringMethod TextureHandle::filter() const { return p_impl->filter; }
+bool TextureHandle::exists() const { return id != 0; }
+u32 TextureHandle::width() const { return w; }
+u32 TextureHandle::height() const { return h; }
+TextureHandle::ColorType TextureHandle::color_type() const { return type; }
+TextureHandle::FilteringMethod TextureHandle::filter() const { return filtering; }
 
-bool operator==(TextureHandle const& a, TextureHandle const& b) {
-    return a.p_impl->handle == b.p_impl->handle;
-}
+bool operator==(TextureHandle const& a, TextureHandle const& b) { return a.id == b.id; }
 
 void TextureHandle::init(
     u32 width, u32 height, ColorType type, FilteringMethod filter, const void* data) {
     ARYIBI_ASSERT(!exists(), "Called init(...) without calling unload() first!");
-    glGenTextures(1, (u32*)&p_impl->handle);
-    glBindTexture(GL_TEXTURE_2D, p_impl->handle);
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
 
-    p_impl->width = width;
-    p_impl->height = height;
-    p_impl->color_type = type;
-    p_impl->filter = filter;
+    w = width;
+    h = height;
+    this->type = type;
+    filtering = filter;
     switch (type) {
         case (ColorType::rgba):
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
@@ -83,6 +67,14 @@ void TextureHandle::init(
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, width, height, 0, GL_RG, GL_UNSIGNED_BYTE, data);
             glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_RED);
             break;
+        case (ColorType::indexed_palette_packed):
+            // Rows of 1 byte texels aren't necessarily a multiple of 4 bytes long.
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, data);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            // Only transparent pixels are stored as 0.
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_RED);
+            break;
         case (ColorType::depth):
             glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, width, height, 0,
                          GL_DEPTH_COMPONENT, GL_FLOAT, data);
@@ -109,23 +101,109 @@ void TextureHandle::init(
     glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border_color);
 
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->handle] = 1;
+    std::lock_guard lock(LiveObjects::textures_mutex);
+    LiveObjects::textures.insert(id);
 #endif
 }
+namespace {
+
+using DecodedPixels = std::unique_ptr<unsigned char, decltype(&stbi_image_free)>;
+
+/// Decodes an image file to RGBA. Safe to call from several threads at once, since the flip
+/// setting is thread-local.
+/// @returns Null if the file couldn't be loaded, with a width and height of 0.
+DecodedPixels decode_file(fs::path const& path, bool flip, u32& width, u32& height) {
+    stbi_set_flip_vertically_on_load_thread(flip);
+    // stb_image leaves these untouched if it fails.
+    int w = 0, h = 0, channels = 0;
+    DecodedPixels pixels(stbi_load(path.generic_string().c_str(), &w, &h, &channels, 4),
+                         &stbi_image_free);
+    width = pixels ? w : 0;
+    height = pixels ? h : 0;
+    return pixels;
+}
+
+/// Converts RGBA pixels to the most compact indexed format the palette fits in.
+std::vector<u8> to_indexed(const u8* rgba,
+                           u32 width,
+                           u32 height,
+                           ColorPalette const& palette,
+                           u32 thread_count,
+                           TextureHandle::ColorType& type) {
+    const PaletteQuantizer quantizer(palette);
+    const auto indexed = quantizer.quantize(rgba, width, height, thread_count);
+    std::vector<u8> result;
+    if (quantizer.fits_packed()) {
+        type = TextureHandle::ColorType::indexed_palette_packed;
+        result.resize(indexed.size());
+        std::transform(indexed.begin(), indexed.end(), result.begin(), PaletteQuantizer::pack);
+    } else {
+        type = TextureHandle::ColorType::indexed_palette;
+        result.resize(indexed.size() * sizeof(PaletteQuantizer::Index));
+        std::memcpy(result.data(), indexed.data(), result.size());
+    }
+    return result;
+}
+
+/// Starts decoding a file on the worker pool, converting it to an indexed format if a palette is
+/// given.
+/// @returns The ID of the load.
+u32 start_texture_load(fs::path const& path,
+                       std::optional<ColorPalette> palette,
+                       TextureHandle::FilteringMethod filter,
+                       bool flip) {
+    auto load = std::make_shared<TextureLoader::Load>();
+    load->filter = filter;
+    u32 load_id;
+    {
+        std::lock_guard lock(TextureLoader::mutex);
+        load_id = TextureLoader::next_id++;
+        TextureLoader::loads.emplace(load_id, load);
+    }
+    TextureLoader::workers.submit([load, path, palette = std::move(palette), flip]() {
+        u32 width = 0, height = 0;
+        std::vector<u8> data;
+        auto type = TextureHandle::ColorType::rgba;
+        if (const auto pixels = decode_file(path, flip, width, height)) {
+            // Other files are being converted in parallel already.
+            if (palette)
+                data = to_indexed(pixels.get(), width, height, *palette, 1, type);
+            else
+                data.assign(pixels.get(), pixels.get() + std::size_t(width) * height * 4);
+        }
+        {
+            std::lock_guard lock(TextureLoader::mutex);
+            load->data = std::move(data);
+            load->width = width;
+            load->height = height;
+            load->type = type;
+            if (TextureLoader::uploader) {
+                load->state = TextureLoader::Load::State::uploading;
+                TextureLoader::uploader->submit(
+                    [load]() { TextureLoader::upload_in_background(*load); });
+            } else {
+                load->state = TextureLoader::Load::State::decoded;
+                TextureLoader::upload_queue.push_back(load);
+            }
+        }
+        TextureLoader::state_changed.notify_all();
+    });
+    return load_id;
+}
+
+} // namespace
+
 TextureHandle
 TextureHandle::from_file_rgba(fs::path const& path, FilteringMethod filter, bool flip) {
-    stbi_set_flip_vertically_on_load(flip);
-    int w, h, channels;
+    u32 w, h;
     TextureHandle tex;
-    unsigned char* data = stbi_load(path.generic_string().c_str(), &w, &h, &channels, 4);
+    const auto data = decode_file(path, flip, w, h);
 
     if (!data)
         // Return empty handle if something went wrong
         return tex;
 
-    tex.init(w, h, ColorType::rgba, filter, data);
-
-    stbi_image_free(data);
+    tex.init(w, h, ColorType::rgba, filter, data.get());
     return tex;
 }
 
@@ -133,361 +211,839 @@ TextureHandle TextureHandle::from_file_indexed(fs::path const& path,
                                                ColorPalette const& palette,
                                                FilteringMethod filter,
                                                bool flip) {
-    stbi_set_flip_vertically_on_load(flip);
-    int w, h, channels;
-    unsigned char* original_data = stbi_load(path.generic_string().c_str(), &w, &h, &channels, 4);
-    constexpr int original_bytes_per_pixel = 4;
-    /// Indexed only has two channels: Red (color) and green (shade)
-    constexpr int indexed_bytes_per_pixel = 2;
-    auto indexed_data = new unsigned char[w * h * indexed_bytes_per_pixel];
-    for (u32 x = 0; x < w; ++x) {
-        for (u32 y = 0; y < h; ++y) {
-            struct {
-                u8 color_index;
-                u8 shade_index;
-            } closest_color;
-            float closest_color_distance = 99999999.f;
-
-            Color raw_original_color;
-            std::memcpy(&raw_original_color.hex_val,
-                        original_data + (x + y * w) * original_bytes_per_pixel, sizeof(u32));
-            if (raw_original_color.alpha() == 0) {
-                // Transparent color
-                closest_color = {0, 0};
-            } else {
-                for (u8 color = 0; color < palette.colors.size(); ++color) {
-                    for (u8 shade = 0; shade < palette.colors[color].shades.size(); ++shade) {
-                        aml::Vector4 this_color{
-                            static_cast<float>(palette.colors[color].shades[shade].red()),
-                            static_cast<float>(palette.colors[color].shades[shade].green()),
-                            static_cast<float>(palette.colors[color].shades[shade].blue()),
-                            static_cast<float>(palette.colors[color].shades[shade].alpha())};
-                        aml::Vector4 original_color{static_cast<float>(raw_original_color.red()),
-                                                    static_cast<float>(raw_original_color.green()),
-                                                    static_cast<float>(raw_original_color.blue()),
-                                                    static_cast<float>(raw_original_color.alpha())};
-                        float color_distance = aml::length(this_color - original_color);
-                        if (closest_color_distance > color_distance) {
-                            closest_color_distance = color_distance;
-                            // Add one to the color and shade because 0,0 is the transparent color
-                            closest_color = {static_cast<u8>(color + 1u),
-                                             static_cast<u8>(shade + 1u)};
-                        }
-                    }
-                }
-            }
+    u32 w, h;
+    TextureHandle tex;
+    const auto original_data = decode_file(path, flip, w, h);
+    if (!original_data)
+        // Return empty handle if something went wrong
+        return tex;
 
-            std::memcpy(indexed_data + (x + y * w) * indexed_bytes_per_pixel,
-                        &closest_color.shade_index, sizeof(u8));
-            std::memcpy(indexed_data + (x + y * w) * indexed_bytes_per_pixel + sizeof(u8),
-                        &closest_color.color_index, sizeof(u8));
+    ColorType type;
+    const auto indexed_data = to_indexed(original_data.get(), w, h, palette, 0, type);
+    tex.init(w, h, type, filter, indexed_data.data());
+    return tex;
+}
+
+TextureLoad
+TextureHandle::from_file_rgba_async(fs::path const& path, FilteringMethod filter, bool flip) {
+    TextureLoad load;
+    load.id = start_texture_load(path, std::nullopt, filter, flip);
+    return load;
+}
+
+TextureLoad TextureHandle::from_file_indexed_async(fs::path const& path,
+                                                   ColorPalette const& palette,
+                                                   FilteringMethod filter,
+                                                   bool flip) {
+    TextureLoad load;
+    load.id = start_texture_load(path, palette, filter, flip);
+    return load;
+}
+
+bool TextureLoad::exists() const {
+    std::lock_guard lock(TextureLoader::mutex);
+    return TextureLoader::loads.count(id);
+}
+
+bool TextureLoad::ready() const {
+    // Commands that use the texture are run after the ones that upload it, so it can be used as
+    // soon as it's uploaded. Staging buffers are deleted separately by the render thread.
+    std::lock_guard lock(TextureLoader::mutex);
+    const auto found = TextureLoader::loads.find(id);
+    ARYIBI_ASSERT(found != TextureLoader::loads.end(),
+                  "Called ready() with a texture load that doesn't exist!");
+    return found->second->state == TextureLoader::Load::State::uploaded;
+}
+
+TextureHandle TextureLoad::get() const {
+    std::shared_ptr<TextureLoader::Load> load;
+    bool needs_upload;
+    {
+        std::unique_lock lock(TextureLoader::mutex);
+        const auto found = TextureLoader::loads.find(id);
+        ARYIBI_ASSERT(found != TextureLoader::loads.end(),
+                      "Called get() with a texture load that doesn't exist!");
+        load = found->second;
+        TextureLoader::loads.erase(found);
+        TextureLoader::state_changed.wait(lock, [&] {
+            return load->state == TextureLoader::Load::State::decoded ||
+                   load->state == TextureLoader::Load::State::uploaded;
+        });
+        needs_upload = load->state == TextureLoader::Load::State::decoded;
+        if (needs_upload) {
+            auto& queue = TextureLoader::upload_queue;
+            queue.erase(std::find(queue.begin(), queue.end(), load));
         }
     }
-    TextureHandle tex;
+    if (needs_upload)
+        TextureLoader::upload(load);
+    return load->texture;
+}
 
-    tex.init(w, h, ColorType::indexed_palette, filter, indexed_data);
+void wait_for_gpu() {
+    const GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    constexpr GLuint64 timeout_ns = 1'000'000'000;
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(fence);
+}
 
-    stbi_image_free(original_data);
-    delete[] indexed_data;
-    return tex;
+void TextureLoader::upload(std::shared_ptr<Load> const& load_ptr) {
+    Load& load = *load_ptr;
+    if (!load.data.empty()) {
+        // Copy the data to a staging buffer, so that the driver can transfer it to the texture
+        // while we carry on instead of before glTexImage2D returns.
+        glCreateBuffers(1, &load.pixel_buffer);
+        glNamedBufferStorage(load.pixel_buffer, load.data.size(), nullptr, GL_MAP_WRITE_BIT);
+        void* staging = glMapNamedBufferRange(load.pixel_buffer, 0, load.data.size(),
+                                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        std::memcpy(staging, load.data.data(), load.data.size());
+        glUnmapNamedBuffer(load.pixel_buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, load.pixel_buffer);
+        // The data pointer is an offset into the pixel buffer while one is bound.
+        load.texture.init(load.width, load.height, load.type, load.filter, nullptr);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        load.upload_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        in_flight.push_back(load_ptr);
+        load.data = {};
+    }
+    std::lock_guard lock(mutex);
+    load.state = Load::State::uploaded;
+}
+
+void TextureLoader::upload_in_background(Load& load) {
+    TextureHandle texture;
+    if (!load.data.empty()) {
+        texture.init(load.width, load.height, load.type, load.filter, load.data.data());
+        wait_for_gpu();
+    }
+    {
+        std::lock_guard lock(mutex);
+        load.texture = texture;
+        load.data = {};
+        load.state = Load::State::uploaded;
+    }
+    state_changed.notify_all();
+}
+
+bool TextureLoader::upload_finished(Load& load) {
+    if (!load.upload_fence)
+        return true;
+    const GLenum status = glClientWaitSync(load.upload_fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        return false;
+    glDeleteSync(load.upload_fence);
+    glDeleteBuffers(1, &load.pixel_buffer);
+    load.upload_fence = nullptr;
+    load.pixel_buffer = 0;
+    return true;
+}
+
+void TextureLoader::upload_decoded(std::chrono::steady_clock::duration budget) {
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+    for (bool first = true;; first = false) {
+        std::shared_ptr<Load> load;
+        {
+            std::lock_guard lock(mutex);
+            if (upload_queue.empty() || (!first && std::chrono::steady_clock::now() >= deadline))
+                break;
+            load = std::move(upload_queue.front());
+            upload_queue.pop_front();
+        }
+        upload(load);
+    }
+    in_flight.erase(std::remove_if(in_flight.begin(), in_flight.end(),
+                                   [](auto const& load) { return upload_finished(*load); }),
+                    in_flight.end());
+}
+
+void TextureLoader::release_all() {
+    for (const auto& load : in_flight) {
+        glDeleteSync(load->upload_fence);
+        glDeleteBuffers(1, &load->pixel_buffer);
+        load->upload_fence = nullptr;
+        load->pixel_buffer = 0;
+    }
+    in_flight.clear();
 }
 
 void TextureHandle::unload() {
     // glDeleteTextures ignores 0s (not created textures)
-    glDeleteTextures(1, &p_impl->handle);
+    glDeleteTextures(1, &id);
 
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->handle] = 0;
+    {
+        std::lock_guard lock(LiveObjects::textures_mutex);
+        LiveObjects::textures.erase(id);
+    }
 #endif
 
-    p_impl->handle = 0;
+    id = 0;
 }
 
-MeshHandle::MeshHandle() : p_impl(std::make_unique<impl>()) {}
-MeshHandle::~MeshHandle() {
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    if (p_impl->vao == 0 || glfwGetCurrentContext() == nullptr)
+bool MeshHandle::exists() const { return id; }
+void MeshHandle::unload() {
+    if (!exists())
         return;
-    ARYIBI_ASSERT(impl::handle_ref_count[p_impl->vao] != 1,
-                  "All handles to a mesh were destroyed without unloading them first!!");
-    impl::handle_ref_count[p_impl->vao]--;
-#endif
-}
-MeshHandle::MeshHandle(MeshHandle const& other) : p_impl(std::make_unique<impl>()) {
-    *p_impl = *other.p_impl;
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->vao]++;
+    LiveObjects::meshes.erase(id);
 #endif
+    VertexArena::get(format).free(first_storage_quad, max_quads);
+    MeshStates::of_mesh.erase(id);
+    id = 0;
 }
-MeshHandle& MeshHandle::operator=(MeshHandle const& other) {
-    if (this != &other) {
-        *p_impl = *other.p_impl;
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-        impl::handle_ref_count[p_impl->vao]++;
-#endif
+
+namespace {
+
+/// Meshes don't own any GL object, so their IDs are just a counter.
+u32 next_mesh_id = 1;
+
+VertexArena vertex_arenas[] = {{VertexFormat::full}, {VertexFormat::compact}};
+
+/// Uploads vertices built by a MeshBuilder to a mesh buffer, starting at the given quad.
+void upload_quads(u32 buffer,
+                  u32 first_quad,
+                  std::vector<float> const& vertices,
+                  VertexFormat format) {
+    if (vertices.empty())
+        return;
+    const std::size_t quad_size = vertices_per_quad * vertex_size(format);
+    const std::size_t quad_count = vertices.size() / (vertices_per_quad * floats_per_vertex);
+    if (format == VertexFormat::compact) {
+        const std::vector<CompactVertex> compact = to_compact_vertices(vertices);
+        glNamedBufferSubData(buffer, first_quad * quad_size, quad_count * quad_size,
+                             compact.data());
+    } else {
+        glNamedBufferSubData(buffer, first_quad * quad_size, quad_count * quad_size,
+                             vertices.data());
     }
-    return *this;
 }
 
-bool MeshHandle::exists() const {
-    ARYIBI_ASSERT((bool)(p_impl->vao) ^ (bool)(p_impl->vbo),
-                  "[Internal error] Only VAO or VBO exist, but not both at once?");
-    return p_impl->vao;
+} // namespace
+
+u32 MeshHandle::quad_count() const { return MeshStates::of(id).quads; }
+u32 MeshHandle::quad_capacity() const { return max_quads; }
+AABB MeshHandle::bounds() const { return MeshStates::of(id).bounds; }
+
+void MeshHandle::write_quads(u32 first_quad, MeshBuilder const& new_quads) {
+    auto& builder = *new_quads.p_impl;
+    const u32 quad_count = builder.result.size() / MeshBuilder::impl::sizeof_quad;
+    ARYIBI_ASSERT(exists(), "Tried to write quads to a mesh that doesn't exist!");
+    auto& state = MeshStates::of_mesh[id];
+    ARYIBI_ASSERT(first_quad + quad_count <= state.quads,
+                  "Tried to write quads out of mesh bounds!");
+    ARYIBI_ASSERT(builder.resolve_format(format) == format,
+                  "The quads given don't fit in the compact vertex format of the mesh!");
+    upload_quads(VertexArena::get(format).buffer, first_storage_quad + first_quad, builder.result,
+                 format);
+    // We can't know the bounds of the quads being overwritten, so just grow the current ones.
+    extend(state.bounds, builder.bounds);
+    ++state.revision;
+    builder.reset();
 }
-void MeshHandle::unload() {
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->vao] = 0;
-#endif
-    // Zeros (non-existent meshes) are silently ignored
-    glDeleteVertexArrays(1, &p_impl->vao);
-    p_impl->vao = 0;
-    glDeleteBuffers(1, &p_impl->vbo);
-    p_impl->vbo = 0;
+
+QuadRange MeshHandle::append_quads(MeshBuilder const& new_quads) {
+    ARYIBI_ASSERT(exists(), "Tried to append quads to a mesh that doesn't exist!");
+    u32& quads = MeshStates::of_mesh[id].quads;
+    const QuadRange range{
+        quads, static_cast<u32>(new_quads.p_impl->result.size() / MeshBuilder::impl::sizeof_quad)};
+    ARYIBI_ASSERT(range.first + range.count <= max_quads,
+                  "Not enough spare capacity in the mesh to append these quads!");
+    quads += range.count;
+    write_quads(range.first, new_quads);
+    return range;
 }
 
-ShaderHandle::ShaderHandle() : p_impl(std::make_unique<impl>()) {}
-ShaderHandle::~ShaderHandle() = default;
-ShaderHandle::ShaderHandle(ShaderHandle const& other) : p_impl(std::make_unique<impl>()) {
-    *p_impl = *other.p_impl;
+QuadRange MeshHandle::remove_quads(QuadRange range) {
+    ARYIBI_ASSERT(exists(), "Tried to remove quads from a mesh that doesn't exist!");
+    auto& state = MeshStates::of_mesh[id];
+    u32& quads = state.quads;
+    ARYIBI_ASSERT(range.first + range.count <= quads, "Tried to remove quads out of mesh bounds!");
+    // Only the quads after the removed range need to be moved, and at most as many as were removed.
+    const u32 quads_after_range = quads - (range.first + range.count);
+    const QuadRange moved{quads - std::min(range.count, quads_after_range),
+                          std::min(range.count, quads_after_range)};
+    const std::size_t quad_size = vertices_per_quad * vertex_size(format);
+    const u32 buffer = VertexArena::get(format).buffer;
+    if (moved.count > 0)
+        glCopyNamedBufferSubData(buffer, buffer, (first_storage_quad + moved.first) * quad_size,
+                                 (first_storage_quad + range.first) * quad_size,
+                                 moved.count * quad_size);
+    quads -= range.count;
+    ++state.revision;
+    return moved;
 }
-ShaderHandle& ShaderHandle::operator=(ShaderHandle const& other) {
-    if (this != &other) {
-        *p_impl = *other.p_impl;
+
+bool ShaderHandle::exists() const { return id; }
+void ShaderHandle::unload() {
+    const auto forget_build = [](u32 program) {
+        if (const auto pending = PendingPrograms::builds.find(program);
+            pending != PendingPrograms::builds.end()) {
+            glDeleteShader(pending->second.vert);
+            glDeleteShader(pending->second.frag);
+            PendingPrograms::builds.erase(pending);
+        }
+    };
+    forget_build(id);
+    if (const auto sources = ShaderSources::of_program.find(id);
+        sources != ShaderSources::of_program.end()) {
+        for (const auto& [defines, program] : sources->second.variants) {
+            forget_build(program);
+            glDeleteProgram(program);
+        }
+        ShaderSources::of_program.erase(sources);
     }
-    return *this;
+    glDeleteProgram(id);
+    id = 0;
 }
 
-bool ShaderHandle::exists() const { return p_impl->handle; }
-void ShaderHandle::unload() {
-    glDeleteProgram(p_impl->handle);
-    p_impl->handle = 0;
+bool has_gl_extension(const char* name) {
+    int extension_count;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+    for (int i = 0; i < extension_count; ++i) {
+        if (std::strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), name) == 0)
+            return true;
+    }
+    return false;
 }
 
-static unsigned int create_shader_stage(GLenum stage, fs::path const& path) {
+namespace {
+
+std::string read_shader_file(fs::path const& path) {
     using namespace std::literals::string_literals;
 
     std::ifstream f(path);
     if (!f.good()) {
         throw std::runtime_error("Failed to open file: "s + path.generic_string());
     }
-    std::string source((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
-    char* src = source.data();
+    return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+/// @returns The defines as they're inserted in a shader.
+std::string define_block(std::vector<ShaderDefine> const& defines) {
+    std::string result;
+    for (const auto& define : defines) result += "#define " + define.name + " " + define.value + "\n";
+    return result;
+}
+
+/// Inserts a block of defines right after the #version line of a shader, which must come first.
+std::string insert_defines(std::string const& source, std::string const& defines) {
+    if (defines.empty())
+        return source;
+    const std::size_t version = source.find("#version");
+    const std::size_t line_end = source.find('\n', version);
+    if (version == std::string::npos || line_end == std::string::npos)
+        return defines + source;
+    // Count the lines before the insertion so that errors still point to the right line.
+    const auto next_line = std::count(source.begin(), source.begin() + line_end, '\n') + 2;
+    return source.substr(0, line_end + 1) + defines + "#line " + std::to_string(next_line) + "\n" +
+           source.substr(line_end + 1);
+}
+
+/// True if the driver can compile shaders in its own threads, and we can ask whether it's done.
+bool parallel_compile_supported() {
+#ifdef GL_KHR_parallel_shader_compile
+    static const bool supported = [] {
+        if (!has_gl_extension("GL_KHR_parallel_shader_compile"))
+            return false;
+        // Let the driver use as many threads as it wants.
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        return true;
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/// Identifies files in the program binary cache, and their format version.
+constexpr u32 program_cache_magic = 0x41525942; // "ARYB"
+
+/// The header of a program binary cache file, which is followed by the binary itself.
+struct ProgramCacheHeader {
+    u32 magic;
+    u32 binary_format;
+    /// Checked too, in case two keys end up in the same file.
+    u64 key;
+    /// How long it took to compile and link the program, to know how much time loading it saves.
+    double compile_seconds;
+};
+
+bool program_cache_enabled() {
+    static const bool binaries_supported = [] {
+        int format_count = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+        return format_count > 0;
+    }();
+    return !ProgramBinaryCache::directory.empty() && binaries_supported;
+}
+
+/// @returns The key of a program in the binary cache. Binaries are only valid for the driver that
+/// created them, so it's part of the key.
+u64 program_cache_key(std::string const& vert_source, std::string const& frag_source) {
+    u64 key = util::fnv1a(vert_source.data(), vert_source.size());
+    // Keep the two sources apart, so that moving text from one to the other changes the key.
+    key = util::fnv1a("\0", 1, key);
+    key = util::fnv1a(frag_source.data(), frag_source.size(), key);
+    for (const GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+        const auto* string = reinterpret_cast<const char*>(glGetString(name));
+        if (string)
+            key = util::fnv1a(string, std::strlen(string), key);
+    }
+    return key;
+}
+
+fs::path program_cache_path(u64 key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+    return ProgramBinaryCache::directory / name;
+}
 
-    unsigned int shader = glCreateShader(stage);
-    glShaderSource(shader, 1, &src, nullptr);
-    glCompileShader(shader);
+/// @returns The program stored in the cache with the given key, or 0 if there's none or it can't
+/// be used anymore (e.g. because the driver was updated).
+/// @param compile_seconds Set to the time it took to compile the program originally.
+unsigned int load_cached_program(u64 key, double& compile_seconds) {
+    std::ifstream file(program_cache_path(key), std::ios::binary);
+    if (!file)
+        return 0;
+    ProgramCacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != program_cache_magic || header.key != key)
+        return 0;
+    const std::vector<char> binary((std::istreambuf_iterator<char>(file)),
+                                   std::istreambuf_iterator<char>());
 
+    unsigned int prog = glCreateProgram();
+    glProgramBinary(prog, header.binary_format, binary.data(), binary.size());
     int success;
-    char infolog[512];
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    glGetProgramiv(prog, GL_LINK_STATUS, &success);
     if (!success) {
-        glGetShaderInfoLog(shader, 512, nullptr, infolog);
-        throw std::runtime_error("Failed to compile shader:\n"s + source + "\nReason: "s + infolog);
+        glDeleteProgram(prog);
+        return 0;
     }
+    compile_seconds = header.compile_seconds;
+    return prog;
+}
 
-    return shader;
+void store_cached_program(u64 key, unsigned int prog, double compile_seconds) {
+    int length = 0;
+    glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> binary(length);
+    GLenum binary_format;
+    glGetProgramBinary(prog, length, nullptr, &binary_format, binary.data());
+
+    std::error_code error;
+    fs::create_directories(ProgramBinaryCache::directory, error);
+    // Write to a temporary file first so that other processes never see half-written entries.
+    const fs::path path = program_cache_path(key);
+    fs::path temporary_path = path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        const ProgramCacheHeader header{program_cache_magic, binary_format, key, compile_seconds};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(binary.data(), binary.size());
+        if (!file) {
+            ARYIBI_LOG("Couldn't write to the program binary cache");
+            return;
+        }
+    }
+    fs::rename(temporary_path, path, error);
 }
 
-ShaderHandle ShaderHandle::from_file(fs::path const& vert_path, fs::path const& frag_path) {
-    using namespace std::literals::string_literals;
+/// Starts building a program out of two shader sources, going through the program binary cache
+/// if it's enabled. Nothing is checked until finish_program(), so that the driver can work on
+/// several programs at once.
+PendingPrograms::Build start_program(std::string vert_source, std::string frag_source) {
+    PendingPrograms::Build build;
+    build.start = std::chrono::steady_clock::now();
+    if (program_cache_enabled()) {
+        build.cache_key = program_cache_key(vert_source, frag_source);
+        double compile_seconds;
+        if ((build.program = load_cached_program(build.cache_key, compile_seconds))) {
+            auto& stats = ProgramBinaryCache::stats;
+            ++stats.hits;
+            stats.seconds_saved +=
+                compile_seconds -
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - build.start)
+                    .count();
+            return build;
+        }
+    }
+
+    // Missing from the cache or stale, so compile it (And replace the entry once it's linked).
+    const auto create_stage = [](GLenum stage, std::string const& source) {
+        const char* src = source.c_str();
+        unsigned int shader = glCreateShader(stage);
+        glShaderSource(shader, 1, &src, nullptr);
+        glCompileShader(shader);
+        return shader;
+    };
+    build.vert = create_stage(GL_VERTEX_SHADER, vert_source);
+    build.frag = create_stage(GL_FRAGMENT_SHADER, frag_source);
+    build.program = glCreateProgram();
+    glAttachShader(build.program, build.vert);
+    glAttachShader(build.program, build.frag);
+    if (build.cache_key != 0)
+        glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(build.program);
+    build.vert_source = std::move(vert_source);
+    build.frag_source = std::move(frag_source);
+    return build;
+}
 
-    unsigned int vtx = create_shader_stage(GL_VERTEX_SHADER, vert_path);
-    unsigned int frag = create_shader_stage(GL_FRAGMENT_SHADER, frag_path);
+/// @returns True if finish_program() wouldn't have to wait for the driver.
+bool program_completed(PendingPrograms::Build const& build) {
+#ifdef GL_KHR_parallel_shader_compile
+    if (build.vert != 0 && parallel_compile_supported()) {
+        int completed;
+        glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &completed);
+        return completed;
+    }
+#endif
+    return true;
+}
 
-    unsigned int prog = glCreateProgram();
-    glAttachShader(prog, vtx);
-    glAttachShader(prog, frag);
+/// Waits for a program to be linked and checks that it was. On failure, the program is deleted
+/// and an exception is thrown.
+void finish_program(PendingPrograms::Build const& build) {
+    using namespace std::literals::string_literals;
+
+    // Programs loaded from the cache were already checked.
+    if (build.vert == 0)
+        return;
 
-    glLinkProgram(prog);
-    int success;
     char infolog[512];
-    glGetProgramiv(prog, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(prog, 512, nullptr, infolog);
-        throw std::runtime_error("Failed to link shader.\nReason: "s + infolog);
+    std::string error;
+    for (const auto& [shader, source] :
+         {std::pair{build.vert, &build.vert_source}, std::pair{build.frag, &build.frag_source}}) {
+        int success;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+        if (!success && error.empty()) {
+            glGetShaderInfoLog(shader, 512, nullptr, infolog);
+            error = "Failed to compile shader:\n"s + *source + "\nReason: "s + infolog;
+        }
+        glDeleteShader(shader);
+    }
+    int success;
+    glGetProgramiv(build.program, GL_LINK_STATUS, &success);
+    if (!success && error.empty()) {
+        glGetProgramInfoLog(build.program, 512, nullptr, infolog);
+        error = "Failed to link shader.\nReason: "s + infolog;
+    }
+    if (!error.empty()) {
+        glDeleteProgram(build.program);
+        throw std::runtime_error(error);
     }
 
-    glDeleteShader(vtx);
-    glDeleteShader(frag);
+    if (build.cache_key != 0) {
+        ++ProgramBinaryCache::stats.misses;
+        store_cached_program(
+            build.cache_key, build.program,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - build.start).count());
+    }
+}
+
+/// Binds the samplers of a linked program to their texture units.
+/// @returns Whether the program has a shadow sampler.
+bool assign_samplers(u32 prog) {
+    const auto assign_sampler = [prog](const char* name, u32 unit) {
+        const int location = glGetUniformLocation(prog, name);
+        if (location != -1)
+            glProgramUniform1i(prog, location, unit);
+        return location != -1;
+    };
+    assign_sampler("tile", texture_units::tile);
+    assign_sampler("palette", texture_units::palette);
+    return assign_sampler("shadow", texture_units::shadow);
+}
 
+} // namespace
+
+void ShaderHandle::set_binary_cache_directory(fs::path const& directory) {
+    ProgramBinaryCache::directory = directory;
+}
+
+ShaderCacheStats ShaderHandle::binary_cache_stats() { return ProgramBinaryCache::stats; }
+
+ShaderHandle ShaderHandle::from_file(fs::path const& vert_path,
+                                     fs::path const& frag_path,
+                                     std::vector<ShaderDefine> const& defines) {
+    ShaderHandle shader = from_file_async(vert_path, frag_path, defines);
+    shader.wait();
+    return shader;
+}
+
+ShaderHandle ShaderHandle::from_source(std::string const& vert_source,
+                                       std::string const& frag_source,
+                                       std::vector<ShaderDefine> const& defines) {
+    ShaderHandle shader = from_source_async(vert_source, frag_source, defines);
+    shader.wait();
+    return shader;
+}
+
+ShaderHandle ShaderHandle::from_file_async(fs::path const& vert_path,
+                                           fs::path const& frag_path,
+                                           std::vector<ShaderDefine> const& defines) {
+    return from_source_async(read_shader_file(vert_path), read_shader_file(frag_path), defines);
+}
+
+ShaderHandle ShaderHandle::from_source_async(std::string const& vert_source,
+                                             std::string const& frag_source,
+                                             std::vector<ShaderDefine> const& defines) {
+    const std::string define_text = define_block(defines);
+    const auto build = start_program(insert_defines(vert_source, define_text),
+                                     insert_defines(frag_source, define_text));
     ShaderHandle shader;
-    shader.p_impl->handle = prog;
-    shader.p_impl->tile_tex_location = glGetUniformLocation(prog, "tile");
-    shader.p_impl->shadow_tex_location = glGetUniformLocation(prog, "shadow");
-    shader.p_impl->palette_tex_location = glGetUniformLocation(prog, "palette");
+    shader.id = build.program;
+    ShaderSources::of_program[shader.id] = {vert_source, frag_source, defines, {}};
+    PendingPrograms::builds.emplace(shader.id, build);
     return shader;
 }
 
-MeshBuilder::MeshBuilder() : p_impl(std::make_unique<impl>()) { p_impl->result.reserve(256); }
-MeshBuilder::~MeshBuilder() = default;
-MeshBuilder::MeshBuilder(MeshBuilder const& other) : p_impl(std::make_unique<impl>()) {
-    *p_impl = *other.p_impl;
-}
-MeshBuilder& MeshBuilder::operator=(MeshBuilder const& other) {
-    if (this != &other) {
-        *p_impl = *other.p_impl;
-    }
-    return *this;
-}
-
-void MeshBuilder::add_sprite(sprites::Sprite const& spr,
-                             aml::Vector3 offset,
-                             float vertical_slope,
-                             float horizontal_slope,
-                             float z_min,
-                             float z_max) {
-    const auto add_piece = [&](sprites::Sprite::Piece const& piece, std::size_t base_n) {
-        auto& result = p_impl->result;
-        const sprites::Rect2D pos_rect{
-            {piece.destination.start.x + offset.x, piece.destination.start.y + offset.y},
-            {piece.destination.end.x + offset.x, piece.destination.end.y + offset.y}};
-        const sprites::Rect2D uv_rect = piece.source;
-        const sprites::Rect2D z_map{
-            {aml::clamp(piece.destination.start.x * horizontal_slope, z_min, z_max),
-             aml::clamp(piece.destination.start.y * vertical_slope, z_min, z_max)},
-            {aml::clamp(piece.destination.end.x * horizontal_slope, z_min, z_max),
-             aml::clamp(piece.destination.end.y * vertical_slope, z_min, z_max)}};
-
-        // First triangle //
-        // First triangle //
-        /* X pos 1st vertex */ result[base_n + 0] = pos_rect.start.x;
-        /* Y pos 1st vertex */ result[base_n + 1] = pos_rect.start.y;
-        /* Z pos 1st vertex */ result[base_n + 2] = z_map.start.x + z_map.start.y + offset.z;
-        /* X UV 1st vertex  */ result[base_n + 3] = uv_rect.start.x;
-        /* Y UV 1st vertex  */ result[base_n + 4] = uv_rect.end.y;
-        /* X pos 2nd vertex */ result[base_n + 5] = pos_rect.end.x;
-        /* Y pos 2nd vertex */ result[base_n + 6] = pos_rect.start.y;
-        /* Z pos 2nd vertex */ result[base_n + 7] = z_map.end.x + z_map.start.y + offset.z;
-        /* X UV 2nd vertex  */ result[base_n + 8] = uv_rect.end.x;
-        /* Y UV 2nd vertex  */ result[base_n + 9] = uv_rect.end.y;
-        /* X pos 3rd vertex */ result[base_n + 10] = pos_rect.start.x;
-        /* Y pos 3rd vertex */ result[base_n + 11] = pos_rect.end.y;
-        /* Z pos 3rd vertex */ result[base_n + 12] = z_map.start.x + z_map.end.y + offset.z;
-        /* X UV 2nd vertex  */ result[base_n + 13] = uv_rect.start.x;
-        /* Y UV 2nd vertex  */ result[base_n + 14] = uv_rect.start.y;
-
-        // Second triangle //
-        /* X pos 1st vertex */ result[base_n + 15] = pos_rect.end.x;
-        /* Y pos 1st vertex */ result[base_n + 16] = pos_rect.start.y;
-        /* Z pos 1st vertex */ result[base_n + 17] = z_map.end.x + z_map.start.y + offset.z;
-        /* X UV 1st vertex  */ result[base_n + 18] = uv_rect.end.x;
-        /* Y UV 1st vertex  */ result[base_n + 19] = uv_rect.end.y;
-        /* X pos 2nd vertex */ result[base_n + 20] = pos_rect.end.x;
-        /* Y pos 2nd vertex */ result[base_n + 21] = pos_rect.end.y;
-        /* Z pos 2nd vertex */ result[base_n + 22] = z_map.end.x + z_map.end.y + offset.z;
-        /* X UV 2nd vertex  */ result[base_n + 23] = uv_rect.end.x;
-        /* Y UV 2nd vertex  */ result[base_n + 24] = uv_rect.start.y;
-        /* X pos 3rd vertex */ result[base_n + 25] = pos_rect.start.x;
-        /* Y pos 3rd vertex */ result[base_n + 26] = pos_rect.end.y;
-        /* Z pos 3rd vertex */ result[base_n + 27] = z_map.start.x + z_map.end.y + offset.z;
-        /* X UV 3rd vertex  */ result[base_n + 28] = uv_rect.start.x;
-        /* Y UV 3rd vertex  */ result[base_n + 29] = uv_rect.start.y;
-    };
+bool ShaderHandle::ready() const {
+    const auto pending = PendingPrograms::builds.find(id);
+    if (pending == PendingPrograms::builds.end())
+        return true;
+    if (!program_completed(pending->second))
+        return false;
+    wait();
+    return true;
+}
 
-    const auto prev_size = p_impl->result.size();
-    p_impl->result.resize(prev_size + spr.pieces.size() * impl::sizeof_quad);
-    for (std::size_t i = 0; i < spr.pieces.size(); ++i) {
-        add_piece(spr.pieces[i], prev_size + i * impl::sizeof_quad);
+void ShaderHandle::wait() const {
+    const auto pending = PendingPrograms::builds.find(id);
+    if (pending == PendingPrograms::builds.end())
+        return;
+    const auto build = std::move(pending->second);
+    PendingPrograms::builds.erase(pending);
+    try {
+        finish_program(build);
+    } catch (...) {
+        ShaderSources::of_program.erase(id);
+        // Failed variants are remembered, so that they aren't compiled again.
+        for (auto& [program, sources] : ShaderSources::of_program) {
+            for (auto& [defines, variant] : sources.variants)
+                if (variant == id)
+                    variant = 0;
+        }
+        throw;
     }
+    const bool lit = assign_samplers(id);
+    // Variants don't have sources of their own.
+    if (const auto sources = ShaderSources::of_program.find(id);
+        sources != ShaderSources::of_program.end())
+        sources->second.lit = lit;
 }
 
-MeshHandle MeshBuilder::finish() const {
-    MeshHandle mesh;
-    glGenVertexArrays(1, &mesh.p_impl->vao);
-    glGenBuffers(1, &mesh.p_impl->vbo);
-
-    // Fill buffer
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.p_impl->vbo);
-    glBufferData(GL_ARRAY_BUFFER, p_impl->result.size() * sizeof(float), p_impl->result.data(),
-                 GL_STATIC_DRAW);
-
-    glBindVertexArray(mesh.p_impl->vao);
-    // Vertex Positions
-    glEnableVertexAttribArray(0); // location 0
-    glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, 0);
-    glBindVertexBuffer(0, mesh.p_impl->vbo, 0, impl::sizeof_vertex * sizeof(float));
-    glVertexAttribBinding(0, 0);
-    // UV Positions
-    glEnableVertexAttribArray(1); // location 1
-    glVertexAttribFormat(1, 2, GL_FLOAT, GL_FALSE, 3 * sizeof(float));
-    glBindVertexBuffer(1, mesh.p_impl->vbo, 0, impl::sizeof_vertex * sizeof(float));
-    glVertexAttribBinding(1, 1);
-
-    mesh.p_impl->vertex_count = p_impl->result.size() / impl::sizeof_vertex;
+ShaderHandle ShaderHandle::variant(std::vector<ShaderDefine> const& defines) const {
+    wait();
+    const auto sources = ShaderSources::of_program.find(id);
+    ARYIBI_ASSERT(sources != ShaderSources::of_program.end(),
+                  "Tried to get a variant of a shader that isn't loaded from source!");
+    auto& [vert, frag, base_defines, variants, lit] = sources->second;
+    const std::string extra_define_text = define_block(defines);
+    if (extra_define_text.empty())
+        return *this;
+    auto variant = variants.find(extra_define_text);
+    if (variant == variants.end()) {
+        // Extra defines come after the base ones, so they can check or override them.
+        const std::string define_text = define_block(base_defines) + extra_define_text;
+        const auto build =
+            start_program(insert_defines(vert, define_text), insert_defines(frag, define_text));
+        PendingPrograms::builds.emplace(build.program, build);
+        variant = variants.emplace(extra_define_text, build.program).first;
+    }
+    ShaderHandle shader;
+    shader.id = variant->second;
+    return shader;
+}
 
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    MeshHandle::impl::handle_ref_count[mesh.p_impl->vao] = 1;
-#endif
-    p_impl->result.clear();
-    return mesh;
+void QuadIndexBuffer::reserve(u32 quads) {
+    if (quads <= quad_capacity)
+        return;
+
+    u32 new_capacity = quad_capacity == 0 ? 1024 : quad_capacity;
+    while (new_capacity < quads) new_capacity *= 2;
+
+    std::vector<u32> indices(new_capacity * indices_per_quad);
+    for (u32 quad = 0; quad < new_capacity; ++quad) {
+        const u32 base_vertex = quad * vertices_per_quad;
+        u32* quad_indices = indices.data() + quad * indices_per_quad;
+        // First triangle
+        quad_indices[0] = base_vertex + 0;
+        quad_indices[1] = base_vertex + 1;
+        quad_indices[2] = base_vertex + 2;
+        // Second triangle
+        quad_indices[3] = base_vertex + 1;
+        quad_indices[4] = base_vertex + 3;
+        quad_indices[5] = base_vertex + 2;
+    }
+
+    if (handle == 0)
+        glCreateBuffers(1, &handle);
+    // Use DSA so that we don't modify the element buffer binding of whatever VAO is bound now.
+    glNamedBufferData(handle, indices.size() * sizeof(u32), indices.data(), GL_STATIC_DRAW);
+    quad_capacity = new_capacity;
 }
 
-Framebuffer::Framebuffer() : p_impl(std::make_unique<impl>()) {
-    p_impl->handle = static_cast<unsigned int>(-1);
+VertexArena& VertexArena::get(VertexFormat format) {
+    return vertex_arenas[static_cast<int>(format)];
 }
-Framebuffer::Framebuffer(TextureHandle const& texture) : p_impl(std::make_unique<impl>()) {
-    p_impl->create_handle();
-    p_impl->tex = texture;
-    p_impl->bind_texture();
+
+void VertexArena::release_all() {
+    for (auto& arena : vertex_arenas) {
+        glDeleteVertexArrays(1, &arena.vao);
+        glDeleteBuffers(1, &arena.buffer);
+        arena = VertexArena{arena.format};
+    }
 }
 
-Framebuffer::Framebuffer(Framebuffer const& other) : p_impl(std::make_unique<impl>()) {
-    p_impl->handle = other.p_impl->handle;
-    p_impl->tex = other.p_impl->tex;
+void VertexArena::set_instance_buffer(u32 instance_buffer) {
+    for (auto& arena : vertex_arenas) {
+        if (arena.vao != 0)
+            glVertexArrayVertexBuffer(arena.vao, vertex_attributes::instance_binding,
+                                      instance_buffer, 0, sizeof(InstanceVertex));
+    }
+}
 
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->handle]++;
-#endif
+u32 VertexArena::allocate(u32 quads) {
+    if (quads == 0)
+        return 0;
+    // First fit. Meshes are usually created once and kept for a long time, so fragmentation isn't
+    // much of a concern.
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+        const auto [first_quad, count] = *it;
+        if (count < quads)
+            continue;
+        free_ranges.erase(it);
+        if (count > quads)
+            free_ranges.emplace(first_quad + quads, count - quads);
+        return first_quad;
+    }
+    grow(quads);
+    return allocate(quads);
 }
 
-Framebuffer::~Framebuffer() {
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    if (p_impl->handle == -1 || p_impl->handle == 0 || glfwGetCurrentContext() == nullptr)
+void VertexArena::free(u32 first_quad, u32 quads) {
+    if (quads == 0)
         return;
-    ARYIBI_ASSERT(impl::handle_ref_count[p_impl->handle] != 1,
-                  "All handles to a framebuffer were destroyed without unloading them first!!");
-    impl::handle_ref_count[p_impl->handle]--;
-#endif
+    auto it = free_ranges.emplace(first_quad, quads).first;
+    // Merge with the adjacent free ranges.
+    const auto next = std::next(it);
+    if (next != free_ranges.end() && first_quad + quads == next->first) {
+        it->second += next->second;
+        free_ranges.erase(next);
+    }
+    if (it != free_ranges.begin()) {
+        const auto prev = std::prev(it);
+        if (prev->first + prev->second == first_quad) {
+            prev->second += it->second;
+            free_ranges.erase(it);
+        }
+    }
 }
 
-Framebuffer& Framebuffer::operator=(Framebuffer const& other) {
-    if (&other == this)
-        return *this;
-
-    p_impl->handle = other.p_impl->handle;
-    p_impl->tex = other.p_impl->tex;
-#ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[p_impl->handle]++;
-#endif
+void VertexArena::grow(u32 min_free_quads) {
+    // A free range at the end of the buffer will be merged with the new space.
+    u32 free_tail = 0;
+    if (!free_ranges.empty()) {
+        const auto& [first_quad, count] = *free_ranges.rbegin();
+        if (first_quad + count == quad_capacity)
+            free_tail = count;
+    }
+    constexpr u32 min_arena_quads = 4096;
+    u32 new_capacity = std::max(min_arena_quads, quad_capacity * 2);
+    while (new_capacity - quad_capacity + free_tail < min_free_quads) new_capacity *= 2;
+
+    const std::size_t stride = vertex_size(format);
+    const std::size_t quad_size = vertices_per_quad * stride;
+    u32 new_buffer;
+    glCreateBuffers(1, &new_buffer);
+    glNamedBufferData(new_buffer, new_capacity * quad_size, nullptr, GL_DYNAMIC_DRAW);
+    if (buffer != 0) {
+        glCopyNamedBufferSubData(buffer, new_buffer, 0, 0, quad_capacity * quad_size);
+        glDeleteBuffers(1, &buffer);
+    }
+    buffer = new_buffer;
+
+    if (vao == 0) {
+        using namespace vertex_attributes;
+        glCreateVertexArrays(1, &vao);
+        glEnableVertexArrayAttrib(vao, position);
+        glEnableVertexArrayAttrib(vao, uv);
+        if (format == VertexFormat::compact) {
+            glVertexArrayAttribFormat(vao, position, 3, GL_HALF_FLOAT, GL_FALSE,
+                                      offsetof(CompactVertex, position));
+            glVertexArrayAttribFormat(vao, uv, 2, GL_UNSIGNED_SHORT, GL_TRUE,
+                                      offsetof(CompactVertex, uv));
+        } else {
+            glVertexArrayAttribFormat(vao, position, 3, GL_FLOAT, GL_FALSE, 0);
+            glVertexArrayAttribFormat(vao, uv, 2, GL_FLOAT, GL_FALSE, 3 * sizeof(float));
+        }
+        glVertexArrayAttribBinding(vao, position, vertex_binding);
+        glVertexArrayAttribBinding(vao, uv, vertex_binding);
+
+        // The renderer binds the buffer these read from every frame.
+        glEnableVertexArrayAttrib(vao, instance_offset);
+        glVertexArrayAttribFormat(vao, instance_offset, 3, GL_FLOAT, GL_FALSE,
+                                  offsetof(InstanceVertex, offset));
+        glVertexArrayAttribBinding(vao, instance_offset, instance_binding);
+        glEnableVertexArrayAttrib(vao, instance_tint);
+        glVertexArrayAttribFormat(vao, instance_tint, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+                                  offsetof(InstanceVertex, tint));
+        glVertexArrayAttribBinding(vao, instance_tint, instance_binding);
+        glVertexArrayBindingDivisor(vao, instance_binding, 1);
+
+        // Meshes use base vertices, so the indices of the first quads are valid for every mesh.
+        glVertexArrayElementBuffer(vao, QuadIndexBuffer::handle);
+    }
+    glVertexArrayVertexBuffer(vao, vertex_attributes::vertex_binding, buffer, 0, stride);
 
-    return *this;
+    const u32 old_capacity = quad_capacity;
+    quad_capacity = new_capacity;
+    free(old_capacity, new_capacity - old_capacity);
 }
 
-void Framebuffer::impl::create_handle() {
-    if (exists()) {
-        glDeleteFramebuffers(1, &handle);
+MeshHandle MeshBuilder::finish(VertexFormat format, u32 quad_capacity) const {
+    MeshHandle mesh;
+    const u32 quads = p_impl->result.size() / impl::sizeof_quad;
+    mesh.max_quads = std::max(quads, quad_capacity);
+    mesh.format = p_impl->resolve_format(format);
+    QuadIndexBuffer::reserve(mesh.max_quads);
+
+    auto& arena = VertexArena::get(mesh.format);
+    mesh.id = next_mesh_id++;
+    MeshStates::of_mesh[mesh.id] = {quads, p_impl->bounds, 0};
+    mesh.first_storage_quad = arena.allocate(mesh.max_quads);
+    upload_quads(arena.buffer, mesh.first_storage_quad, p_impl->result, mesh.format);
+
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-        impl::handle_ref_count[handle]--;
+    LiveObjects::meshes.insert(mesh.id);
 #endif
-    }
-    glCreateFramebuffers(1, &handle);
+    p_impl->reset();
+    return mesh;
+}
+
+Framebuffer::Framebuffer(TextureHandle const& texture) : tex(texture) {
+    glCreateFramebuffers(1, &id);
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-    impl::handle_ref_count[handle] = 1;
+    LiveObjects::framebuffers.insert(id);
 #endif
+    attach_texture();
 }
 
-void Framebuffer::impl::bind_texture() {
+void Framebuffer::attach_texture() {
     ARYIBI_ASSERT(exists(),
-                  "[Internal error] Called impl::bind_texture with non-existent framebuffer?");
-    glBindFramebuffer(GL_FRAMEBUFFER, handle);
+                  "[Internal error] Called attach_texture with non-existent framebuffer?");
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
     switch (tex.color_type()) {
         case TextureHandle::ColorType::rgba:
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                                   tex.p_impl->handle, 0);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex.id, 0);
             break;
         case TextureHandle::ColorType::depth:
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                                   tex.p_impl->handle, 0);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex.id, 0);
             break;
         default: assert(false && "Unknown color type"); return;
     }
@@ -495,31 +1051,29 @@ void Framebuffer::impl::bind_texture() {
     glClear(GL_COLOR_BUFFER_BIT);
 }
 
-bool Framebuffer::impl::exists() const { return handle != static_cast<u32>(-1); }
-
-bool Framebuffer::exists() const { return p_impl->exists(); }
+bool Framebuffer::exists() const { return id != static_cast<u32>(-1); }
 
 void Framebuffer::resize(u32 width, u32 height) {
     ARYIBI_ASSERT(exists(), "Tried to resize non-existent framebuffer!");
-    auto& tex = p_impl->tex;
     const auto prev_color_type = tex.color_type();
     const auto prev_filter_type = tex.filter();
     tex.unload();
     tex.init(width, height, prev_color_type, prev_filter_type);
-    p_impl->bind_texture();
+    attach_texture();
 }
 
-TextureHandle const& Framebuffer::texture() const { return p_impl->tex; }
+TextureHandle const& Framebuffer::texture() const { return tex; }
 
 void Framebuffer::unload() {
     if (glfwGetCurrentContext() == nullptr)
         return;
-    p_impl->tex.unload();
-    if (p_impl->handle != static_cast<unsigned int>(-1)) {
-        glDeleteFramebuffers(1, &p_impl->handle);
+    tex.unload();
+    if (exists()) {
+        glDeleteFramebuffers(1, &id);
 #ifdef ARYIBI_DETECT_RENDERER_LEAKS
-        impl::handle_ref_count[p_impl->handle] = 0;
+        LiveObjects::framebuffers.erase(id);
 #endif
+        id = static_cast<u32>(-1);
     }
 }
 
@@ -530,7 +1084,19 @@ namespace std {
 std::size_t
 hash<aryibi::renderer::TextureHandle>::operator()(aryibi::renderer::TextureHandle const& tex) const
     noexcept {
-    return reinterpret_cast<std::size_t>(tex.imgui_id());
+    return std::hash<anton::u32>{}(tex.id);
+}
+
+std::size_t
+hash<aryibi::renderer::MeshHandle>::operator()(aryibi::renderer::MeshHandle const& mesh) const
+    noexcept {
+    return std::hash<anton::u32>{}(mesh.id);
+}
+
+std::size_t
+hash<aryibi::renderer::ShaderHandle>::operator()(aryibi::renderer::ShaderHandle const& shader) const
+    noexcept {
+    return std::hash<anton::u32>{}(shader.id);
 }
 
 } // namespace std
\ No newline at end of file
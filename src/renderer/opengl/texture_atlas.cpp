@@ -0,0 +1,149 @@
+/* clang-format off */
+#include <glad/glad.h>
+/* clang-format on */
+
+#include "aryibi/texture_atlas.hpp"
+#include "renderer/rect_packer.hpp"
+#include "util/aryibi_assert.hpp"
+
+#include <cstdio>
+
+namespace aryibi::renderer {
+
+namespace {
+
+/// How pixels of each color type are laid out when uploading them.
+struct PixelFormat {
+    GLenum format;
+    u32 size;
+};
+
+PixelFormat pixel_format(TextureHandle::ColorType type) {
+    switch (type) {
+        case TextureHandle::ColorType::rgba: return {GL_RGBA, 4};
+        case TextureHandle::ColorType::indexed_palette: return {GL_RG, 2};
+        case TextureHandle::ColorType::indexed_palette_packed: return {GL_RED, 1};
+        default:
+            ARYIBI_ASSERT(false, "Texture atlases don't support this ColorType!");
+            return {GL_RGBA, 4};
+    }
+}
+
+/// Fills the padding around an image by repeating its outermost pixels.
+void fill_padding(u32 texture, u32 x, u32 y, u32 width, u32 height, u32 padding) {
+    const auto copy = [texture](u32 src_x, u32 src_y, u32 dst_x, u32 dst_y, u32 w, u32 h) {
+        glCopyImageSubData(texture, GL_TEXTURE_2D, 0, src_x, src_y, 0, texture, GL_TEXTURE_2D, 0,
+                           dst_x, dst_y, 0, w, h, 1);
+    };
+    for (u32 i = 1; i <= padding; ++i) {
+        copy(x, y, x - i, y, 1, height);
+        copy(x + width - 1, y, x + width - 1 + i, y, 1, height);
+    }
+    // Rows are copied after columns, so that they include the corners.
+    for (u32 i = 1; i <= padding; ++i) {
+        copy(x - padding, y, x - padding, y - i, width + 2 * padding, 1);
+        copy(x - padding, y + height - 1, x - padding, y + height - 1 + i, width + 2 * padding, 1);
+    }
+}
+
+} // namespace
+
+struct TextureAtlas::impl {
+    TextureHandle::ColorType type;
+    TextureHandle::FilteringMethod filter;
+    u32 page_size;
+    u32 padding;
+    std::vector<TextureHandle> pages;
+    /// The space used in each page.
+    std::vector<RectPacker> packers;
+
+    /// Reserves space for an image, creating a new page if needed.
+    /// @returns False if the image is too big to fit in a page.
+    bool place(u32 width, u32 height, std::size_t& page, u32& x, u32& y) {
+        const u32 padded_width = width + 2 * padding;
+        const u32 padded_height = height + 2 * padding;
+        if (padded_width > page_size || padded_height > page_size)
+            return false;
+        for (page = 0; page < pages.size(); ++page) {
+            if (packers[page].insert(padded_width, padded_height, x, y))
+                break;
+        }
+        if (page == pages.size()) {
+            TextureHandle new_page;
+            new_page.init(page_size, page_size, type, filter);
+            // Pages start fully transparent, which is all zeros for every color type.
+            glClearTexImage(new_page.id, 0, pixel_format(type).format, GL_UNSIGNED_BYTE, nullptr);
+            pages.push_back(new_page);
+            packers.emplace_back(page_size, page_size);
+            [[maybe_unused]] const bool placed =
+                packers.back().insert(padded_width, padded_height, x, y);
+            ARYIBI_ASSERT(placed, "[Internal error] Image doesn't fit in an empty atlas page?");
+        }
+        x += padding;
+        y += padding;
+        return true;
+    }
+
+    /// Finishes adding an image whose pixels have already been written to a page.
+    sprites::TextureChunk finish(std::size_t page, u32 x, u32 y, u32 width, u32 height) {
+        // Pages have no mipmaps, since their minification filter doesn't use them.
+        fill_padding(pages[page].id, x, y, width, height, padding);
+        const float size = static_cast<float>(page_size);
+        return {pages[page], {{x / size, y / size}, {(x + width) / size, (y + height) / size}}};
+    }
+};
+
+TextureAtlas::TextureAtlas(TextureHandle::ColorType type,
+                           TextureHandle::FilteringMethod filter,
+                           u32 page_size,
+                           u32 padding) :
+    p_impl(std::make_unique<impl>(impl{type, filter, page_size, padding, {}, {}})) {
+    ARYIBI_ASSERT(type != TextureHandle::ColorType::depth,
+                  "Texture atlases can't hold depth textures!");
+}
+
+TextureAtlas::TextureAtlas(TextureAtlas&&) noexcept = default;
+TextureAtlas& TextureAtlas::operator=(TextureAtlas&&) noexcept = default;
+TextureAtlas::~TextureAtlas() = default;
+
+sprites::TextureChunk TextureAtlas::add(u32 width, u32 height, const void* data) {
+    std::size_t page;
+    u32 x, y;
+    if (!p_impl->place(width, height, page, x, y)) {
+        ARYIBI_LOG("Tried to add an image bigger than a page to a texture atlas!");
+        return {};
+    }
+    const PixelFormat format = pixel_format(p_impl->type);
+    // Rows of indexed pixels aren't necessarily a multiple of 4 bytes long.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTextureSubImage2D(p_impl->pages[page].id, 0, x, y, width, height, format.format,
+                        GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return p_impl->finish(page, x, y, width, height);
+}
+
+sprites::TextureChunk TextureAtlas::add(TextureHandle const& texture) {
+    ARYIBI_ASSERT(texture.exists(), "Tried to add a texture that doesn't exist to an atlas!");
+    ARYIBI_ASSERT(texture.color_type() == p_impl->type,
+                  "Tried to add a texture with a different color type to an atlas!");
+    std::size_t page;
+    u32 x, y;
+    if (!p_impl->place(texture.width(), texture.height(), page, x, y)) {
+        ARYIBI_LOG("Tried to add an image bigger than a page to a texture atlas!");
+        return {};
+    }
+    // Copying between textures doesn't go through the CPU.
+    glCopyImageSubData(texture.id, GL_TEXTURE_2D, 0, 0, 0, 0, p_impl->pages[page].id,
+                       GL_TEXTURE_2D, 0, x, y, 0, texture.width(), texture.height(), 1);
+    return p_impl->finish(page, x, y, texture.width(), texture.height());
+}
+
+std::vector<TextureHandle> const& TextureAtlas::pages() const { return p_impl->pages; }
+
+void TextureAtlas::unload() {
+    for (auto& page : p_impl->pages) page.unload();
+    p_impl->pages.clear();
+    p_impl->packers.clear();
+}
+
+} // namespace aryibi::renderer
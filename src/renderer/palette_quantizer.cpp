@@ -0,0 +1,128 @@
+#include "aryibi/palette_quantizer.hpp"
+
+#include "util/aryibi_assert.hpp"
+#include "util/parallel_for.hpp"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+
+namespace aryibi::renderer {
+
+namespace {
+
+/// Images are split in groups of this many rows, which are quantized in parallel.
+constexpr u32 rows_per_job = 16;
+/// Size of the color cache used by each job. Must be a power of two.
+constexpr std::size_t cache_size = 1024;
+
+/// Remembers the result of the last colors quantized. Pixel art uses few colors, so nearly every
+/// pixel is found here. Pixels with zero alpha are never cached, which means a key of 0 can mark
+/// empty entries.
+struct ColorCache {
+    std::array<u32, cache_size> keys{};
+    std::array<PaletteQuantizer::Index, cache_size> values;
+
+    static std::size_t slot(u32 color) {
+        // Fibonacci hashing, so that colors that differ in a single channel don't collide.
+        return (color * 2654435769u) >> 22u;
+    }
+};
+static_assert(cache_size == 1u << (32u - 22u));
+
+/// Finds the closest shade to a color.
+/// @param distances Scratch storage, with one element for each shade.
+PaletteQuantizer::Index closest_shade(Color color,
+                                      std::vector<i32> const& reds,
+                                      std::vector<i32> const& greens,
+                                      std::vector<i32> const& blues,
+                                      std::vector<i32> const& alphas,
+                                      std::vector<PaletteQuantizer::Index> const& indices,
+                                      std::vector<i32>& distances) {
+    const i32 red = color.red(), green = color.green(), blue = color.blue(),
+              alpha = color.alpha();
+    const std::size_t count = indices.size();
+    // Squared distances of 8-bit channels are exact integers, so comparing them gives exactly the
+    // same order as comparing actual distances. Both loops vectorize.
+    for (std::size_t i = 0; i < count; ++i) {
+        const i32 dr = reds[i] - red, dg = greens[i] - green, db = blues[i] - blue,
+                  da = alphas[i] - alpha;
+        distances[i] = dr * dr + dg * dg + db * db + da * da;
+    }
+    i32 min_distance = distances[0];
+    for (std::size_t i = 1; i < count; ++i) min_distance = std::min(min_distance, distances[i]);
+    const auto first_closest = std::find(distances.begin(), distances.end(), min_distance);
+    return indices[first_closest - distances.begin()];
+}
+
+} // namespace
+
+PaletteQuantizer::PaletteQuantizer(ColorPalette const& palette) {
+    ARYIBI_ASSERT(palette.colors.size() <= 255, "Palettes can't have more than 255 colors!");
+    for (std::size_t color = 0; color < palette.colors.size(); ++color) {
+        const auto& shades = palette.colors[color].shades;
+        ARYIBI_ASSERT(shades.size() <= 255, "Palette colors can't have more than 255 shades!");
+        // Indices start at 1, so a nibble can hold up to 15 of them.
+        if (color + 1 > 0xF || shades.size() > 0xF)
+            fits_packed_format = false;
+        for (std::size_t shade = 0; shade < shades.size(); ++shade) {
+            reds.push_back(shades[shade].red());
+            greens.push_back(shades[shade].green());
+            blues.push_back(shades[shade].blue());
+            alphas.push_back(shades[shade].alpha());
+            // Add one to the color and shade because 0,0 is the transparent color
+            indices.push_back({static_cast<u8>(shade + 1u), static_cast<u8>(color + 1u)});
+        }
+    }
+}
+
+PaletteQuantizer::Index PaletteQuantizer::quantize(Color color) const {
+    if (color.alpha() == 0 || indices.empty())
+        return {0, 0};
+    std::vector<i32> distances(indices.size());
+    return closest_shade(color, reds, greens, blues, alphas, indices, distances);
+}
+
+void PaletteQuantizer::quantize(
+    const u8* rgba, u32 width, u32 height, Index* result, u32 thread_count) const {
+    if (indices.empty()) {
+        std::fill(result, result + std::size_t(width) * height, Index{0, 0});
+        return;
+    }
+
+    const std::size_t job_count = (height + rows_per_job - 1) / rows_per_job;
+    util::parallel_for(job_count, thread_count, [&](std::size_t job) {
+        // Each job has its own cache, so that threads never have to synchronize.
+        auto cache = std::make_unique<ColorCache>();
+        std::vector<i32> distances(indices.size());
+        const std::size_t first_pixel = job * rows_per_job * std::size_t(width);
+        const std::size_t last_pixel =
+            std::min<std::size_t>(height, (job + 1) * rows_per_job) * std::size_t(width);
+        for (std::size_t pixel = first_pixel; pixel < last_pixel; ++pixel) {
+            const u8* channels = rgba + pixel * 4;
+            const Color color(u32(channels[0]) | (u32(channels[1]) << 8u) |
+                              (u32(channels[2]) << 16u) | (u32(channels[3]) << 24u));
+            if (color.alpha() == 0) {
+                // Transparent color
+                result[pixel] = {0, 0};
+                continue;
+            }
+            const std::size_t slot = ColorCache::slot(color.hex_val);
+            if (cache->keys[slot] != color.hex_val) {
+                cache->keys[slot] = color.hex_val;
+                cache->values[slot] =
+                    closest_shade(color, reds, greens, blues, alphas, indices, distances);
+            }
+            result[pixel] = cache->values[slot];
+        }
+    });
+}
+
+std::vector<PaletteQuantizer::Index>
+PaletteQuantizer::quantize(const u8* rgba, u32 width, u32 height, u32 thread_count) const {
+    std::vector<Index> result(std::size_t(width) * height);
+    quantize(rgba, width, height, result.data(), thread_count);
+    return result;
+}
+
+} // namespace aryibi::renderer
@@ -0,0 +1,73 @@
+#include "renderer/rect_packer.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace aryibi::renderer {
+
+void RectPacker::reset(u32 width, u32 height) {
+    area_width = width;
+    area_height = height;
+    skyline.clear();
+    if (width > 0)
+        skyline.push_back({0, 0, width});
+}
+
+bool RectPacker::insert(u32 rect_width, u32 rect_height, u32& x, u32& y) {
+    if (rect_width == 0 || rect_height == 0 || rect_width > area_width ||
+        rect_height > area_height)
+        return false;
+
+    // Try placing the rectangle at the start of every segment, resting on the highest segment
+    // below it.
+    std::size_t best_segment = skyline.size();
+    u32 best_top = std::numeric_limits<u32>::max();
+    u32 best_y = 0;
+    for (std::size_t i = 0; i < skyline.size(); ++i) {
+        if (skyline[i].x + rect_width > area_width)
+            break;
+        u32 rect_y = 0;
+        for (std::size_t j = i; j < skyline.size() && skyline[j].x < skyline[i].x + rect_width;
+             ++j)
+            rect_y = std::max(rect_y, skyline[j].y);
+        // Ties go to the leftmost position, since segments are visited from left to right.
+        if (rect_y + rect_height <= area_height && rect_y + rect_height < best_top) {
+            best_segment = i;
+            best_top = rect_y + rect_height;
+            best_y = rect_y;
+        }
+    }
+    if (best_segment == skyline.size())
+        return false;
+    x = skyline[best_segment].x;
+    y = best_y;
+
+    // Replace the segments under the rectangle with its top edge. The last one might only be
+    // partially covered.
+    const u32 rect_end = x + rect_width;
+    std::size_t last_covered = best_segment;
+    while (last_covered < skyline.size() &&
+           skyline[last_covered].x + skyline[last_covered].width <= rect_end)
+        ++last_covered;
+    if (last_covered < skyline.size() && skyline[last_covered].x < rect_end) {
+        Segment& partial = skyline[last_covered];
+        partial.width -= rect_end - partial.x;
+        partial.x = rect_end;
+    }
+    skyline.erase(skyline.begin() + best_segment, skyline.begin() + last_covered);
+    skyline.insert(skyline.begin() + best_segment, Segment{x, best_top, rect_width});
+
+    // Merge the new segment with neighbours at the same height.
+    std::size_t merged = best_segment;
+    if (merged + 1 < skyline.size() && skyline[merged + 1].y == best_top) {
+        skyline[merged].width += skyline[merged + 1].width;
+        skyline.erase(skyline.begin() + merged + 1);
+    }
+    if (merged > 0 && skyline[merged - 1].y == best_top) {
+        skyline[merged - 1].width += skyline[merged].width;
+        skyline.erase(skyline.begin() + merged);
+    }
+    return true;
+}
+
+} // namespace aryibi::renderer
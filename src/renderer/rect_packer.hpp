@@ -0,0 +1,40 @@
+#ifndef ARYIBI_RECT_PACKER_HPP
+#define ARYIBI_RECT_PACKER_HPP
+
+#include "aryibi/renderer.hpp"
+
+#include <vector>
+
+namespace aryibi::renderer {
+
+/// Places rectangles inside a bigger one without overlapping, one at a time, using the skyline
+/// bottom-left heuristic: The top edge of everything placed so far is kept as a list of horizontal
+/// segments, and each rectangle goes where its top edge ends up the lowest. Rectangles are never
+/// moved once placed, so it can be used to fill a texture incrementally.
+class RectPacker {
+public:
+    explicit RectPacker(u32 width = 0, u32 height = 0) { reset(width, height); }
+
+    /// Removes every rectangle and changes the size of the area to fill.
+    void reset(u32 width, u32 height);
+    /// Finds a place for a rectangle and reserves it.
+    /// @returns False if the rectangle doesn't fit anywhere, in which case nothing changes.
+    [[nodiscard]] bool insert(u32 rect_width, u32 rect_height, u32& x, u32& y);
+
+    [[nodiscard]] u32 width() const { return area_width; }
+    [[nodiscard]] u32 height() const { return area_height; }
+
+private:
+    struct Segment {
+        u32 x, y, width;
+    };
+
+    u32 area_width = 0;
+    u32 area_height = 0;
+    /// Sorted by x, covering the whole width without gaps. Neighbours never have the same y.
+    std::vector<Segment> skyline;
+};
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_RECT_PACKER_HPP
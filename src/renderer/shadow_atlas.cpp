@@ -0,0 +1,142 @@
+#include "renderer/shadow_atlas.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace aryibi::renderer {
+
+void ShadowAtlas::reset(u32 deepest_level) {
+    max_level = deepest_level;
+    free_nodes.assign(max_level + 1, {});
+    free_nodes[0].insert(node_key(0, 0));
+    assigned.clear();
+}
+
+void ShadowAtlas::allocate(std::vector<Request> const& requests, std::vector<Tile>& result) {
+    if (free_nodes.empty())
+        reset(max_level);
+
+    // The ideal level of each light gives it a share of the atlas area proportional to its
+    // importance, rounded down to the next tile size.
+    const float total_importance =
+        std::accumulate(requests.begin(), requests.end(), 0.f,
+                        [](float sum, Request const& request) { return sum + request.importance; });
+    std::vector<float> exact_levels(requests.size());
+    std::vector<u32> levels(requests.size());
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+        if (requests[i].importance <= 0)
+            continue;
+        // Each level has a quarter of the area of the previous one.
+        const float share = requests[i].importance / total_importance;
+        exact_levels[i] = std::clamp(-std::log2(share) / 2.f, 0.f, static_cast<float>(max_level));
+        levels[i] = static_cast<u32>(std::ceil(exact_levels[i]));
+    }
+
+    // Keep the tiles that are one of the two sizes closest to the ideal one, and free the rest.
+    // This way, small changes in importance don't move tiles around.
+    std::unordered_map<u32, Node> kept;
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+        const auto it = assigned.find(requests[i].light);
+        if (it == assigned.end())
+            continue;
+        if (requests[i].importance > 0 &&
+            std::abs(static_cast<float>(it->second.level) - exact_levels[i]) < 1.f)
+            kept.emplace(*it);
+        else
+            free_node(it->second);
+        assigned.erase(it);
+    }
+    // Lights that weren't requested this frame don't need their tile anymore.
+    for (const auto& [light, node] : assigned) free_node(node);
+    assigned = std::move(kept);
+
+    // Allocate the biggest tiles first, since those are the hardest to fit.
+    std::vector<std::size_t> order(requests.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](std::size_t a, std::size_t b) { return levels[a] < levels[b]; });
+    bool fragmented = false;
+    for (const std::size_t i : order) {
+        if (requests[i].importance <= 0 || assigned.count(requests[i].light))
+            continue;
+        Node node;
+        if (!allocate_node(levels[i], node)) {
+            fragmented = true;
+            break;
+        }
+        assigned.emplace(requests[i].light, node);
+    }
+
+    // The kept tiles can leave the atlas too fragmented for the new ones. In that case start over,
+    // which always fits every light unless they're all clamped to the smallest tile size.
+    if (fragmented) {
+        reset(max_level);
+        for (const std::size_t i : order) {
+            if (requests[i].importance <= 0)
+                continue;
+            // Lights that don't fit get a smaller tile instead, if there's space for one.
+            for (u32 level = levels[i]; level <= max_level; ++level) {
+                Node node;
+                if (allocate_node(level, node)) {
+                    assigned.emplace(requests[i].light, node);
+                    break;
+                }
+            }
+        }
+    }
+
+    result.resize(requests.size());
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+        const auto it = assigned.find(requests[i].light);
+        if (it == assigned.end()) {
+            result[i] = Tile{};
+            continue;
+        }
+        const float size = 1.f / static_cast<float>(1u << it->second.level);
+        result[i] = {{static_cast<float>(it->second.x) * size,
+                      static_cast<float>(it->second.y) * size},
+                     size};
+    }
+}
+
+bool ShadowAtlas::allocate_node(u32 level, Node& result) {
+    auto& free = free_nodes[level];
+    if (!free.empty()) {
+        const u64 key = *free.begin();
+        free.erase(free.begin());
+        result = {level, static_cast<u32>(key >> 32), static_cast<u32>(key)};
+        return true;
+    }
+    // Split a bigger tile, keeping the other three quarters free.
+    Node parent;
+    if (level == 0 || !allocate_node(level - 1, parent))
+        return false;
+    const u32 x = parent.x * 2, y = parent.y * 2;
+    free.insert(node_key(x + 1, y));
+    free.insert(node_key(x, y + 1));
+    free.insert(node_key(x + 1, y + 1));
+    result = {level, x, y};
+    return true;
+}
+
+void ShadowAtlas::free_node(Node node) {
+    // Merge the node with its siblings while all of them are free.
+    while (node.level > 0) {
+        auto& free = free_nodes[node.level];
+        const u32 x = node.x & ~1u, y = node.y & ~1u;
+        const u64 siblings[] = {node_key(x, y), node_key(x + 1, y), node_key(x, y + 1),
+                                node_key(x + 1, y + 1)};
+        const u64 self = node_key(node.x, node.y);
+        if (!std::all_of(std::begin(siblings), std::end(siblings),
+                         [&](u64 key) { return key == self || free.count(key) != 0; }))
+            break;
+        for (const u64 key : siblings) free.erase(key);
+        node = {node.level - 1, x / 2, y / 2};
+    }
+    free_nodes[node.level].insert(node_key(node.x, node.y));
+}
+
+u64 ShadowAtlas::node_key(u32 x, u32 y) { return static_cast<u64>(x) << 32 | y; }
+
+} // namespace aryibi::renderer
@@ -0,0 +1,56 @@
+#ifndef ARYIBI_SHADOW_ATLAS_HPP
+#define ARYIBI_SHADOW_ATLAS_HPP
+
+#include "aryibi/renderer.hpp"
+
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace aryibi::renderer {
+
+/// Assigns square tiles of the shadow map texture to lights. Tiles come from a quadtree: Level 0 is
+/// the whole atlas, and each level splits every tile of the previous one in four. Lights keep
+/// their tile from one frame to the next unless its ideal size changes by more than a level, so
+/// that the shadow maps drawn in them can be reused.
+class ShadowAtlas {
+public:
+    /// A tile in UV coordinates. Lights without a tile get one with a size of 0.
+    struct Tile {
+        anton::math::Vector2 position;
+        float size = 0;
+    };
+    struct Request {
+        /// Identifies the light across frames.
+        u32 light;
+        /// Relative amount of the atlas the light should get. Lights with an importance of 0 don't
+        /// get a tile.
+        float importance;
+    };
+
+    /// Frees every tile. Tiles are never smaller than 1/2^deepest_level of the atlas' side.
+    void reset(u32 deepest_level);
+    /// Gives each light a tile with an area roughly proportional to its importance. If there
+    /// isn't enough space for every light, the least important ones don't get a tile. Lights
+    /// missing from `requests` lose their tile.
+    /// @param result Set to the tile of each request, in the same order.
+    void allocate(std::vector<Request> const& requests, std::vector<Tile>& result);
+
+private:
+    struct Node {
+        u32 level, x, y;
+    };
+    [[nodiscard]] bool allocate_node(u32 level, Node& result);
+    void free_node(Node node);
+    [[nodiscard]] static u64 node_key(u32 x, u32 y);
+
+    u32 max_level = 0;
+    /// The free nodes of each level, keyed by node_key(). Ordered so that allocations are
+    /// deterministic.
+    std::vector<std::set<u64>> free_nodes;
+    std::unordered_map<u32, Node> assigned;
+};
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_SHADOW_ATLAS_HPP
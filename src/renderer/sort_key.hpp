@@ -0,0 +1,38 @@
+#ifndef ARYIBI_SORT_KEY_HPP
+#define ARYIBI_SORT_KEY_HPP
+
+#include "aryibi/renderer.hpp"
+
+#include <anton/math/math.hpp>
+
+namespace aryibi::renderer {
+
+/// Sort keys are made of four 16-bit fields: The shader and texture ranks, the vertex format, and
+/// the quantized distance to the camera. Their order depends on the DrawOrder requested.
+namespace sort_key {
+
+/// @returns The shader rank, texture rank and vertex format of a command, in the lowest 48 bits.
+inline u64 state(u16 shader_rank, u16 texture_rank, VertexFormat format) {
+    return static_cast<u64>(shader_rank) << 32u | static_cast<u64>(texture_rank) << 16u |
+           static_cast<u64>(format);
+}
+
+/// @returns The distance from the camera to a command, quantized to 16 bits. The camera sees
+/// everything from 0 to 20 units below it. Higher Z is closer.
+inline u64 depth(float camera_z, float z) {
+    const float distance = anton::math::clamp((camera_z - z) / 20.f, 0.f, 1.f);
+    return static_cast<u64>(distance * 0xFFFF);
+}
+
+/// @returns The key that sorts a command in the given order. Not meant for DrawOrder::submission.
+inline u64 make(DrawOrder order, u64 state_key, u64 depth_key) {
+    if (order == DrawOrder::back_to_front)
+        return (0xFFFF - depth_key) << 48u | state_key;
+    return state_key << 16u | depth_key;
+}
+
+} // namespace sort_key
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_SORT_KEY_HPP
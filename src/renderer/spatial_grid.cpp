@@ -0,0 +1,88 @@
+#include "renderer/spatial_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace aryibi::renderer {
+
+namespace {
+
+/// Objects that would be inserted in more cells than this go into the oversized list instead.
+constexpr i64 max_cells_per_object = 64;
+/// Cell coordinates are clamped to this, so that huge or infinite areas still give valid (If big)
+/// ranges.
+constexpr float max_cell_coordinate = 1 << 30;
+
+} // namespace
+
+void SpatialGrid::clear() {
+    // Keep the cell vectors around to avoid reallocating them every frame.
+    for (auto& [key, objects] : cells) objects.clear();
+    oversized.clear();
+}
+
+void SpatialGrid::insert(u32 object, AABB const& bounds) {
+    if (bounds.empty())
+        return;
+    if (object >= last_query.size())
+        last_query.resize(object + 1, 0);
+
+    const CellRange range = cells_overlapping(bounds);
+    if ((range.max_x - range.min_x + 1) * (range.max_y - range.min_y + 1) > max_cells_per_object) {
+        oversized.push_back(object);
+        return;
+    }
+    for (i64 y = range.min_y; y <= range.max_y; ++y) {
+        for (i64 x = range.min_x; x <= range.max_x; ++x) cells[cell_key(x, y)].push_back(object);
+    }
+}
+
+void SpatialGrid::query(AABB const& area, std::vector<u32>& result) {
+    result.clear();
+    if (area.empty())
+        return;
+    ++query_count;
+    const auto add = [&](u32 object) {
+        if (last_query[object] == query_count)
+            return;
+        last_query[object] = query_count;
+        result.push_back(object);
+    };
+
+    for (const u32 object : oversized) add(object);
+    const CellRange range = cells_overlapping(area);
+    const i64 range_cells = (range.max_x - range.min_x + 1) * (range.max_y - range.min_y + 1);
+    if (range_cells > static_cast<i64>(cells.size())) {
+        // Big areas touch more cells than there are in use, so go through the used ones instead.
+        for (const auto& [key, objects] : cells) {
+            const i64 x = static_cast<i32>(key >> 32);
+            const i64 y = static_cast<i32>(key & 0xFFFFFFFF);
+            if (x < range.min_x || x > range.max_x || y < range.min_y || y > range.max_y)
+                continue;
+            for (const u32 object : objects) add(object);
+        }
+        return;
+    }
+    for (i64 y = range.min_y; y <= range.max_y; ++y) {
+        for (i64 x = range.min_x; x <= range.max_x; ++x) {
+            const auto it = cells.find(cell_key(x, y));
+            if (it == cells.end())
+                continue;
+            for (const u32 object : it->second) add(object);
+        }
+    }
+}
+
+SpatialGrid::CellRange SpatialGrid::cells_overlapping(AABB const& area) const {
+    const auto cell_of = [this](float coordinate) {
+        return static_cast<i64>(std::clamp(std::floor(coordinate / cell_size),
+                                           -max_cell_coordinate, max_cell_coordinate));
+    };
+    return {cell_of(area.min.x), cell_of(area.min.y), cell_of(area.max.x), cell_of(area.max.y)};
+}
+
+u64 SpatialGrid::cell_key(i64 x, i64 y) {
+    return static_cast<u64>(static_cast<u32>(x)) << 32 | static_cast<u32>(y);
+}
+
+} // namespace aryibi::renderer
@@ -0,0 +1,46 @@
+#ifndef ARYIBI_SPATIAL_GRID_HPP
+#define ARYIBI_SPATIAL_GRID_HPP
+
+#include "aryibi/renderer.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+namespace aryibi::renderer {
+
+/// Uniform grid over the XY plane, used to quickly find the objects inside an area without testing
+/// every single one. Z is ignored since scenes are mostly flat.
+class SpatialGrid {
+public:
+    explicit SpatialGrid(float cell_size = 16.f) : cell_size(cell_size) {}
+
+    /// Removes every object from the grid.
+    void clear();
+    /// Adds an object to every cell its bounds touch. Objects are identified by small, dense
+    /// indices. Objects with empty bounds are ignored.
+    void insert(u32 object, AABB const& bounds);
+    /// Fills `result` with every object whose cells overlap `area` in the XY plane, each one only
+    /// once and in no particular order. Objects returned might not actually overlap `area`, but
+    /// every object that does is returned.
+    void query(AABB const& area, std::vector<u32>& result);
+
+private:
+    struct CellRange {
+        i64 min_x, min_y, max_x, max_y;
+    };
+    [[nodiscard]] CellRange cells_overlapping(AABB const& area) const;
+    [[nodiscard]] static u64 cell_key(i64 x, i64 y);
+
+    float cell_size;
+    std::unordered_map<u64, std::vector<u32>> cells;
+    /// Objects that touch too many cells to be worth inserting in each of them. These are returned
+    /// by every query.
+    std::vector<u32> oversized;
+    /// The last query each object was returned by, to avoid returning it twice.
+    std::vector<u32> last_query;
+    u32 query_count = 0;
+};
+
+} // namespace aryibi::renderer
+
+#endif // ARYIBI_SPATIAL_GRID_HPP
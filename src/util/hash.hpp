@@ -0,0 +1,29 @@
+#ifndef ARYIBI_HASH_HPP
+#define ARYIBI_HASH_HPP
+
+#include <anton/types.hpp>
+
+#include <cstddef>
+
+namespace aryibi::util {
+
+constexpr anton::u64 fnv1a_offset_basis = 14695981039346656037ull;
+
+/// Hashes some bytes with 64-bit FNV-1a. Fast and good enough to tell whether some data changed, but
+/// not meant for anything security related.
+/// @param hash The hash of any previous data, to hash several pieces of data as if they were
+/// contiguous.
+inline anton::u64
+fnv1a(const void* data, std::size_t size, anton::u64 hash = fnv1a_offset_basis) {
+    constexpr anton::u64 fnv1a_prime = 1099511628211ull;
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= fnv1a_prime;
+    }
+    return hash;
+}
+
+} // namespace aryibi::util
+
+#endif // ARYIBI_HASH_HPP
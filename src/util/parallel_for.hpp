@@ -0,0 +1,63 @@
+#ifndef ARYIBI_PARALLEL_FOR_HPP
+#define ARYIBI_PARALLEL_FOR_HPP
+
+#include <anton/types.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aryibi::util {
+
+/// @returns The amount of threads to use when the user asks for `requested` threads, where 0 means
+/// "as many as there are cores".
+inline anton::u32 resolve_thread_count(anton::u32 requested) {
+    if (requested != 0)
+        return requested;
+    const anton::u32 hardware_threads = std::thread::hardware_concurrency();
+    return hardware_threads == 0 ? 1 : hardware_threads;
+}
+
+/// Calls `fn(i)` for every i in [0, count) using up to `thread_count` threads, the calling thread
+/// included. Indices are handed out dynamically, so there are no guarantees about which thread
+/// processes which index, or in what order. If any call throws, the remaining indices are skipped
+/// and the first exception is rethrown once every thread has finished.
+/// @param thread_count How many threads to use. 0 means std::thread::hardware_concurrency().
+template<typename F> void parallel_for(std::size_t count, anton::u32 thread_count, F const& fn) {
+    thread_count = std::min<std::size_t>(resolve_thread_count(thread_count), count);
+    if (thread_count <= 1) {
+        for (std::size_t i = 0; i < count; ++i) fn(i);
+        return;
+    }
+
+    std::atomic<std::size_t> next_index = 0;
+    std::exception_ptr first_exception;
+    std::mutex exception_mutex;
+    const auto worker = [&]() {
+        try {
+            for (std::size_t i = next_index++; i < count; i = next_index++) fn(i);
+        } catch (...) {
+            next_index = count;
+            std::lock_guard lock(exception_mutex);
+            if (!first_exception)
+                first_exception = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (anton::u32 i = 0; i < thread_count - 1; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads) thread.join();
+
+    if (first_exception)
+        std::rethrow_exception(first_exception);
+}
+
+} // namespace aryibi::util
+
+#endif // ARYIBI_PARALLEL_FOR_HPP
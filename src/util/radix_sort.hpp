@@ -0,0 +1,57 @@
+#ifndef ARYIBI_RADIX_SORT_HPP
+#define ARYIBI_RADIX_SORT_HPP
+
+#include <anton/types.hpp>
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace aryibi::util {
+
+/// An element to sort: A key and the index of whatever it was generated from.
+struct SortItem {
+    anton::u64 key;
+    anton::u32 index;
+};
+
+/// Sorts items by key in ascending order. The sort is stable, so items with equal keys keep their
+/// relative order. Uses a LSD radix sort on 8-bit digits, skipping the digits that are the same for
+/// every key (Usually most of them, since keys tend to be made out of small indices).
+/// @param scratch Storage used during the sort. Passing the same vector every frame avoids
+/// reallocating it.
+inline void radix_sort(std::vector<SortItem>& items, std::vector<SortItem>& scratch) {
+    constexpr std::size_t digit_count = sizeof(anton::u64);
+    constexpr std::size_t bucket_count = 256;
+    if (items.size() < 2)
+        return;
+
+    // Count every digit in a single pass over the data.
+    std::vector<std::array<std::size_t, bucket_count>> histograms(digit_count);
+    for (auto& histogram : histograms) histogram.fill(0);
+    for (const auto& item : items) {
+        for (std::size_t digit = 0; digit < digit_count; ++digit)
+            ++histograms[digit][(item.key >> (digit * 8)) & 0xFF];
+    }
+
+    scratch.resize(items.size());
+    for (std::size_t digit = 0; digit < digit_count; ++digit) {
+        auto& histogram = histograms[digit];
+        // If every item has the same value in this digit, this pass wouldn't change anything.
+        if (histogram[(items[0].key >> (digit * 8)) & 0xFF] == items.size())
+            continue;
+
+        std::size_t offset = 0;
+        for (auto& count : histogram) {
+            const std::size_t bucket_size = count;
+            count = offset;
+            offset += bucket_size;
+        }
+        for (const auto& item : items) scratch[histogram[(item.key >> (digit * 8)) & 0xFF]++] = item;
+        items.swap(scratch);
+    }
+}
+
+} // namespace aryibi::util
+
+#endif // ARYIBI_RADIX_SORT_HPP
@@ -0,0 +1,76 @@
+#ifndef ARYIBI_THREAD_POOL_HPP
+#define ARYIBI_THREAD_POOL_HPP
+
+#include "util/parallel_for.hpp"
+
+#include <anton/types.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aryibi::util {
+
+/// A fixed set of threads that run jobs in the order they were submitted. Threads are only started
+/// when the first job is submitted. Destroying the pool waits for the jobs being run to finish and
+/// discards the ones that haven't been started.
+class ThreadPool {
+public:
+    /// Creates a pool with as many threads as hardware threads.
+    ThreadPool() = default;
+    /// @param thread_count How many threads to use. 0 means std::thread::hardware_concurrency().
+    explicit ThreadPool(anton::u32 thread_count) : thread_count(thread_count) {}
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        job_available.notify_all();
+        for (auto& thread : threads) thread.join();
+    }
+
+    /// Queues a job to be run by one of the threads. Jobs must not throw.
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard lock(mutex);
+            if (threads.empty()) {
+                const anton::u32 count = resolve_thread_count(thread_count);
+                for (anton::u32 i = 0; i < count; ++i) threads.emplace_back([this] { work(); });
+            }
+            jobs.push_back(std::move(job));
+        }
+        job_available.notify_one();
+    }
+
+private:
+    void work() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock lock(mutex);
+                job_available.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping)
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    anton::u32 thread_count = 0;
+    std::mutex mutex;
+    std::condition_variable job_available;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+} // namespace aryibi::util
+
+#endif // ARYIBI_THREAD_POOL_HPP
@@ -9,6 +9,9 @@ namespace aryibi::windowing {
 
 struct WindowHandle::impl {
     GLFWwindow* handle = nullptr;
+    /// Hidden window whose context shares objects with the one of handle, so that resources can be
+    /// created from another thread. Null if it couldn't be created.
+    GLFWwindow* loader_context = nullptr;
     double init_time;
     static inline bool initialized_glfw = false;
 };
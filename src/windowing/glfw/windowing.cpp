@@ -50,10 +50,20 @@ void WindowHandle::init(u32 width,
     p_impl->handle = glfwCreateWindow(width, height, title.data(),
                                       is_fullscreen ? glfwGetPrimaryMonitor() : nullptr, nullptr);
     p_impl->init_time = glfwGetTime();
+    if (!p_impl->handle)
+        return;
+
+    // Any other hints still apply, so that both contexts are created with the same settings.
+    const auto visible_it = hint_flags.values.find(WindowHint::visible);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    p_impl->loader_context = glfwCreateWindow(1, 1, "", nullptr, p_impl->handle);
+    glfwWindowHint(GLFW_VISIBLE, visible_it == hint_flags.values.end() || visible_it->second);
 }
 
 void WindowHandle::unload() {
     ARYIBI_ASSERT(exists(), "Tried to unload window that doesn't exist!");
+    if (p_impl->loader_context)
+        glfwDestroyWindow(p_impl->loader_context);
     glfwDestroyWindow(p_impl->handle);
 }
 
@@ -0,0 +1,18 @@
+#ifndef ARYIBI_TESTS_CHECK_HPP
+#define ARYIBI_TESTS_CHECK_HPP
+
+#include <cstdio>
+
+/// Like assert(), but also checked in release builds, and reported without stopping the test so
+/// that every failure is shown. Tests return check_failures from main.
+inline int check_failures = 0;
+
+#define CHECK(condition)                                                                           \
+    do {                                                                                           \
+        if (!(condition)) {                                                                        \
+            std::fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #condition);    \
+            ++check_failures;                                                                      \
+        }                                                                                          \
+    } while (false)
+
+#endif // ARYIBI_TESTS_CHECK_HPP
@@ -0,0 +1,86 @@
+#include "renderer/sort_key.hpp"
+#include "util/radix_sort.hpp"
+
+#include "check.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace aryibi;
+using namespace aryibi::renderer;
+
+namespace {
+
+void radix_sort_is_stable() {
+    std::mt19937_64 rng(1);
+    for (const std::size_t count : {0u, 1u, 2u, 100u, 10000u}) {
+        std::vector<util::SortItem> items, scratch;
+        for (u32 i = 0; i < count; ++i) {
+            // Few distinct keys, so that there are many ties, spread over every digit.
+            const u64 key = (rng() % 16) << ((rng() % 8) * 8);
+            items.push_back({key, i});
+        }
+        auto expected = items;
+        std::stable_sort(expected.begin(), expected.end(),
+                         [](auto const& a, auto const& b) { return a.key < b.key; });
+        util::radix_sort(items, scratch);
+        bool same = items.size() == expected.size();
+        for (std::size_t i = 0; same && i < items.size(); ++i)
+            same = items[i].key == expected[i].key && items[i].index == expected[i].index;
+        CHECK(same);
+    }
+}
+
+void radix_sort_skips_constant_digits() {
+    // Every key is equal, so the order can't change at all.
+    std::vector<util::SortItem> items, scratch;
+    for (u32 i = 0; i < 100; ++i) items.push_back({0x0123456789ABCDEFu, i});
+    util::radix_sort(items, scratch);
+    bool in_order = true;
+    for (u32 i = 0; i < 100; ++i) in_order &= items[i].index == i;
+    CHECK(in_order);
+}
+
+void key_layout() {
+    const u64 state = sort_key::state(0x1234, 0x5678, VertexFormat::compact);
+    CHECK(state == (0x1234ull << 32u | 0x5678ull << 16u | u64(VertexFormat::compact)));
+    CHECK(sort_key::make(DrawOrder::state, state, 0x9ABC) == (state << 16u | 0x9ABC));
+    CHECK(sort_key::make(DrawOrder::back_to_front, state, 0x9ABC) ==
+          ((0xFFFFull - 0x9ABC) << 48u | state));
+
+    // The camera sees 20 units below it, and anything outside of that is clamped.
+    CHECK(sort_key::depth(10, 10) == 0);
+    CHECK(sort_key::depth(10, 20) == 0);
+    CHECK(sort_key::depth(10, -10) == 0xFFFF);
+    CHECK(sort_key::depth(10, -100) == 0xFFFF);
+    CHECK(sort_key::depth(10, 5) < sort_key::depth(10, 0));
+}
+
+void key_order() {
+    const u64 closer = sort_key::depth(0, -1), further = sort_key::depth(0, -10);
+    const u64 a = sort_key::state(0, 1, VertexFormat::full);
+    const u64 b = sort_key::state(1, 0, VertexFormat::full);
+    // State order groups by shader first, then texture, then format, then closest first.
+    CHECK(sort_key::make(DrawOrder::state, a, further) <
+          sort_key::make(DrawOrder::state, b, closer));
+    CHECK(sort_key::make(DrawOrder::state, a, closer) <
+          sort_key::make(DrawOrder::state, a, further));
+    CHECK(sort_key::make(DrawOrder::state, sort_key::state(0, 0, VertexFormat::compact), closer) >
+          sort_key::make(DrawOrder::state, sort_key::state(0, 0, VertexFormat::full), further));
+    // Back to front order draws the furthest first, then groups by state at the same depth.
+    CHECK(sort_key::make(DrawOrder::back_to_front, b, further) <
+          sort_key::make(DrawOrder::back_to_front, a, closer));
+    CHECK(sort_key::make(DrawOrder::back_to_front, a, further) <
+          sort_key::make(DrawOrder::back_to_front, b, further));
+}
+
+} // namespace
+
+int main() {
+    radix_sort_is_stable();
+    radix_sort_skips_constant_digits();
+    key_layout();
+    key_order();
+    return check_failures;
+}
@@ -0,0 +1,72 @@
+#include "aryibi/renderer.hpp"
+#include "aryibi/sprites.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+using namespace aryibi;
+using namespace aryibi::renderer;
+
+namespace {
+
+constexpr u32 map_size = 512, layer_count = 3, chunk_size = 32;
+
+/// @returns The fastest time out of a few runs, in milliseconds.
+template<typename F> double time_ms(F&& function) {
+    double best = 1e30;
+    for (int run = 0; run < 5; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        function();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+void add_tile(MeshBuilder& builder, sprites::Sprite const& sprite, u32 x, u32 y, u32 layer) {
+    builder.add_sprite(sprite,
+                       {static_cast<float>(x), static_cast<float>(y), static_cast<float>(layer)},
+                       0.5f);
+}
+
+} // namespace
+
+int main() {
+    sprites::Sprite sprite;
+    sprite.pieces.push_back({{{0, 0}, {1 / 16.f, 1 / 16.f}}, {{0, 0}, {1, 1}}});
+
+    const double serial_ms = time_ms([&] {
+        MeshBuilder builder;
+        for (u32 layer = 0; layer < layer_count; ++layer)
+            for (u32 y = 0; y < map_size; ++y)
+                for (u32 x = 0; x < map_size; ++x) add_tile(builder, sprite, x, y, layer);
+    });
+    std::printf("%ux%u map, %u layers, serial add_sprite: %.2f ms\n", map_size, map_size,
+                layer_count, serial_ms);
+
+    // The map is split in square chunks, each with all of its layers.
+    constexpr u32 chunks_per_side = map_size / chunk_size;
+    const u32 hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (u32 threads = 1;; threads = std::min(threads * 2, hardware_threads)) {
+        const double ms = time_ms([&] {
+            MeshBuilder builder;
+            builder.add_chunks_parallel(
+                chunks_per_side * chunks_per_side,
+                [&](MeshBuilder& chunk, std::size_t index) {
+                    const u32 chunk_x = index % chunks_per_side * chunk_size,
+                              chunk_y = index / chunks_per_side * chunk_size;
+                    for (u32 layer = 0; layer < layer_count; ++layer)
+                        for (u32 y = chunk_y; y < chunk_y + chunk_size; ++y)
+                            for (u32 x = chunk_x; x < chunk_x + chunk_size; ++x)
+                                add_tile(chunk, sprite, x, y, layer);
+                },
+                threads);
+        });
+        std::printf("%ux%u map, %u layers, %u threads: %.2f ms (%.2fx)\n", map_size, map_size,
+                    layer_count, threads, ms, serial_ms / ms);
+        if (threads == hardware_threads)
+            break;
+    }
+}
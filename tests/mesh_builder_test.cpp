@@ -0,0 +1,100 @@
+#include "aryibi/renderer.hpp"
+#include "aryibi/sprites.hpp"
+
+#include "check.hpp"
+
+#include <vector>
+
+using namespace aryibi;
+using namespace aryibi::renderer;
+
+namespace {
+
+constexpr u32 map_width = 37, map_height = 29, layer_count = 3;
+
+/// A sprite of one or two pieces, different for each tile so that every quad is distinct.
+sprites::Sprite tile_sprite(u32 x, u32 y, u32 layer) {
+    sprites::Sprite sprite;
+    const float u = static_cast<float>((x * 7 + y * 3 + layer) % 16) / 16.f;
+    sprite.pieces.push_back({{{u, 0}, {u + 1 / 16.f, 1 / 16.f}}, {{0, 0}, {1, 1}}});
+    if ((x + y + layer) % 4 == 0)
+        sprite.pieces.push_back({{{0, u}, {1 / 16.f, u + 1 / 16.f}}, {{0, 1}, {1, 2}}});
+    return sprite;
+}
+
+/// Each row of the map is a chunk, with its layers one after another.
+void build_row(MeshBuilder& builder, u32 y, std::vector<QuadRange>& ranges) {
+    for (u32 layer = 0; layer < layer_count; ++layer) {
+        for (u32 x = 0; x < map_width; ++x)
+            ranges.push_back(builder.add_sprite(
+                tile_sprite(x, y, layer),
+                {static_cast<float>(x), static_cast<float>(y), static_cast<float>(layer)}, 0.5f));
+    }
+}
+
+/// Builds the map with one add_sprite call after another, after some quads that were already
+/// there.
+MeshBuilder build_serially(float first_offset, std::vector<QuadRange>& ranges) {
+    MeshBuilder builder;
+    builder.add_sprite(tile_sprite(0, 0, 0), {first_offset, 0, 0});
+    for (u32 y = 0; y < map_height; ++y) build_row(builder, y, ranges);
+    return builder;
+}
+
+void parallel_matches_serial(float first_offset) {
+    std::vector<QuadRange> serial_ranges;
+    const MeshBuilder serial = build_serially(first_offset, serial_ranges);
+    for (const u32 threads : {1u, 3u, 8u}) {
+        MeshBuilder parallel;
+        parallel.add_sprite(tile_sprite(0, 0, 0), {first_offset, 0, 0});
+        std::vector<std::vector<QuadRange>> chunk_sprite_ranges(map_height);
+        const auto chunk_ranges = parallel.add_chunks_parallel(
+            map_height,
+            [&](MeshBuilder& chunk, std::size_t y) {
+                build_row(chunk, static_cast<u32>(y), chunk_sprite_ranges[y]);
+            },
+            threads);
+
+        CHECK(parallel.vertices() == serial.vertices());
+        CHECK(parallel.stats(VertexFormat::compact).format ==
+              serial.stats(VertexFormat::compact).format);
+        // Ranges within a chunk are relative to the chunk.
+        CHECK(chunk_ranges.size() == map_height);
+        bool same_ranges = true;
+        std::size_t sprite = 0;
+        for (u32 y = 0; y < map_height; ++y) {
+            for (const auto& range : chunk_sprite_ranges[y]) {
+                const auto& expected = serial_ranges[sprite++];
+                same_ranges &= chunk_ranges[y].first + range.first == expected.first &&
+                               range.count == expected.count;
+            }
+        }
+        CHECK(same_ranges);
+    }
+}
+
+void empty_chunks() {
+    MeshBuilder builder;
+    const auto ranges = builder.add_chunks_parallel(
+        4,
+        [](MeshBuilder& chunk, std::size_t index) {
+            if (index == 2)
+                chunk.add_sprite(tile_sprite(1, 1, 1), {0, 0, 0});
+        },
+        2);
+    CHECK(ranges.size() == 4);
+    CHECK(ranges[0].count == 0 && ranges[1].count == 0 && ranges[3].count == 0);
+    CHECK(ranges[2].first == 0 && ranges[2].count == tile_sprite(1, 1, 1).pieces.size());
+    CHECK(ranges[3].first == ranges[2].count);
+    CHECK(builder.stats().quad_count == ranges[2].count);
+}
+
+} // namespace
+
+int main() {
+    parallel_matches_serial(0);
+    // Too far away for half floats, so only the full format can be used.
+    parallel_matches_serial(100000);
+    empty_chunks();
+    return check_failures;
+}
@@ -0,0 +1,58 @@
+#include "aryibi/palette_quantizer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace aryibi::renderer;
+
+namespace {
+
+/// @returns The fastest time out of a few runs, in milliseconds.
+template<typename F> double time_ms(F&& function) {
+    double best = 1e30;
+    for (int run = 0; run < 5; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        function();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 rng(1);
+    ColorPalette palette;
+    for (u32 c = 0; c < 15; ++c) {
+        ColorPalette::ColorShades color;
+        for (u32 s = 0; s < 8; ++s) color.shades.emplace_back(u32(rng()) | 0xFF000000u);
+        palette.colors.push_back(color);
+    }
+    const PaletteQuantizer quantizer(palette);
+
+    constexpr u32 width = 2048, height = 2048;
+    // Noise is the worst case, since the color cache barely helps. Pixel art uses few colors.
+    std::vector<u8> noise(width * height * 4), pixel_art(width * height * 4);
+    for (auto& channel : noise) channel = static_cast<u8>(rng());
+    std::vector<u32> art_colors(32);
+    for (auto& color : art_colors) color = u32(rng()) | 0xFF000000u;
+    for (u32 pixel = 0; pixel < width * height; ++pixel) {
+        const u32 color = art_colors[(pixel / 8 + pixel / width / 8) % art_colors.size()];
+        for (u32 c = 0; c < 4; ++c) pixel_art[pixel * 4 + c] = (color >> (c * 8u)) & 0xFFu;
+    }
+
+    std::vector<PaletteQuantizer::Index> result(width * height);
+    for (const auto& [name, image] :
+         {std::pair{"noise", &noise}, std::pair{"pixel art", &pixel_art}}) {
+        for (const u32 threads : {1u, 0u}) {
+            const double ms = time_ms(
+                [&] { quantizer.quantize(image->data(), width, height, result.data(), threads); });
+            std::printf("%ux%u %s, %s: %.2f ms\n", width, height, name,
+                        threads == 1 ? "1 thread" : "all threads", ms);
+        }
+    }
+}
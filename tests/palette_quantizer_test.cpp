@@ -0,0 +1,132 @@
+#include "aryibi/palette_quantizer.hpp"
+
+#include "check.hpp"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace aryibi::renderer;
+
+namespace {
+
+/// The per-pixel search TextureHandle::from_file_indexed used to do: The first shade with the
+/// smallest distance wins.
+PaletteQuantizer::Index reference_quantize(ColorPalette const& palette, Color color) {
+    if (color.alpha() == 0)
+        return {0, 0};
+    PaletteQuantizer::Index closest{0, 0};
+    float closest_distance = 99999999.f;
+    for (std::size_t c = 0; c < palette.colors.size(); ++c) {
+        for (std::size_t s = 0; s < palette.colors[c].shades.size(); ++s) {
+            const Color shade = palette.colors[c].shades[s];
+            const float dr = float(shade.red()) - float(color.red()),
+                        dg = float(shade.green()) - float(color.green()),
+                        db = float(shade.blue()) - float(color.blue()),
+                        da = float(shade.alpha()) - float(color.alpha());
+            const float distance = std::sqrt(dr * dr + dg * dg + db * db + da * da);
+            if (closest_distance > distance) {
+                closest_distance = distance;
+                closest = {static_cast<u8>(s + 1u), static_cast<u8>(c + 1u)};
+            }
+        }
+    }
+    return closest;
+}
+
+bool operator==(PaletteQuantizer::Index a, PaletteQuantizer::Index b) {
+    return a.shade == b.shade && a.color == b.color;
+}
+
+ColorPalette random_palette(std::mt19937& rng, u32 colors, u32 shades) {
+    ColorPalette palette;
+    for (u32 c = 0; c < colors; ++c) {
+        ColorPalette::ColorShades color;
+        for (u32 s = 0; s < shades; ++s) color.shades.emplace_back(u32(rng()) | 0x80000000u);
+        palette.colors.push_back(color);
+    }
+    return palette;
+}
+
+void matches_reference() {
+    std::mt19937 rng(1);
+    ColorPalette palette = random_palette(rng, 12, 6);
+    // Identical shades are always equally close, so the first one must win.
+    palette.colors[3].shades[2] = palette.colors[1].shades[4];
+    palette.colors[7].shades[0] = palette.colors[7].shades[5] = palette.colors[2].shades[1];
+
+    constexpr u32 width = 257, height = 93;
+    std::vector<u8> rgba(width * height * 4);
+    for (auto& channel : rgba) channel = static_cast<u8>(rng());
+    for (u32 pixel = 0; pixel < width * height; ++pixel) {
+        // Also use few distinct colors, as pixel art does, so that the cache gets used.
+        if (pixel % 3 == 0)
+            for (u32 c = 0; c < 4; ++c) rgba[pixel * 4 + c] = rgba[(pixel % 64) * 4 + c];
+        if (pixel % 7 == 0)
+            rgba[pixel * 4 + 3] = 0;
+    }
+    // Pixels equal to the tied shades.
+    for (u32 c = 0; c < 4; ++c) {
+        rgba[4 + c] = (palette.colors[1].shades[4].hex_val >> (c * 8u)) & 0xFFu;
+        rgba[8 + c] = (palette.colors[2].shades[1].hex_val >> (c * 8u)) & 0xFFu;
+    }
+
+    const PaletteQuantizer quantizer(palette);
+    CHECK(quantizer.shade_count() == 12 * 6);
+    for (const u32 threads : {1u, 4u}) {
+        const auto result = quantizer.quantize(rgba.data(), width, height, threads);
+        bool all_match = true;
+        for (u32 pixel = 0; pixel < width * height; ++pixel) {
+            Color color;
+            color.hex_val = rgba[pixel * 4] | (rgba[pixel * 4 + 1] << 8u) |
+                            (rgba[pixel * 4 + 2] << 16u) | (u32(rgba[pixel * 4 + 3]) << 24u);
+            all_match &= result[pixel] == reference_quantize(palette, color);
+            all_match &= quantizer.quantize(color) == result[pixel];
+        }
+        CHECK(all_match);
+        CHECK((result[1] == PaletteQuantizer::Index{5, 2}));
+        CHECK((result[2] == PaletteQuantizer::Index{2, 3}));
+    }
+}
+
+void ties_go_to_first_shade() {
+    ColorPalette palette;
+    palette.colors.push_back({{Color(u8(10), 10, 10), Color(u8(20), 20, 20)}});
+    palette.colors.push_back({{Color(u8(10), 10, 10)}});
+    const PaletteQuantizer quantizer(palette);
+    // Exactly halfway between both shades of the first color.
+    CHECK((quantizer.quantize(Color(u8(15), 15, 15)) == PaletteQuantizer::Index{1, 1}));
+    // Same as the first shade of both colors.
+    CHECK((quantizer.quantize(Color(u8(10), 10, 10)) == PaletteQuantizer::Index{1, 1}));
+    CHECK((quantizer.quantize(Color(u8(20), 20, 20)) == PaletteQuantizer::Index{2, 1}));
+}
+
+void transparent_pixels() {
+    ColorPalette palette;
+    palette.colors.push_back({{Color(u8(0), 0, 0, 0), Color(u8(255), 255, 255)}});
+    const PaletteQuantizer quantizer(palette);
+    CHECK((quantizer.quantize(Color(u8(1), 2, 3, 0)) == PaletteQuantizer::Index{0, 0}));
+    CHECK((quantizer.quantize(Color(u8(1), 2, 3, 1)) == PaletteQuantizer::Index{1, 1}));
+
+    const PaletteQuantizer empty(ColorPalette{});
+    const u8 pixel[4] = {1, 2, 3, 4};
+    CHECK((empty.quantize(pixel, 1, 1)[0] == PaletteQuantizer::Index{0, 0}));
+}
+
+void packing() {
+    std::mt19937 rng(2);
+    CHECK(PaletteQuantizer(random_palette(rng, 15, 15)).fits_packed());
+    CHECK(!PaletteQuantizer(random_palette(rng, 16, 1)).fits_packed());
+    CHECK(!PaletteQuantizer(random_palette(rng, 1, 16)).fits_packed());
+    CHECK(PaletteQuantizer::pack({0x3, 0xA}) == 0xA3);
+}
+
+} // namespace
+
+int main() {
+    matches_reference();
+    ties_go_to_first_shade();
+    transparent_pixels();
+    packing();
+    return check_failures;
+}